@@ -0,0 +1,32 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include "Simd.h"
+
+// Exponential backoff for compare-and-swap loops. Each failed attempt
+// waits twice as long as the previous one before retrying, so threads
+// contending for the same cache line stop taking it from each other.
+// After c_maxSpins, the thread yields instead of spinning.
+class Backoff
+{
+public:
+	static constexpr uint32_t c_maxSpins = 1024;
+
+	void pause()
+	{
+		if (m_spins > c_maxSpins)
+		{
+			std::this_thread::yield();
+			return;
+		}
+
+		for (uint32_t i = 0; i < m_spins; i++)
+			Simd::pause();
+
+		m_spins *= 2;
+	}
+
+private:
+	uint32_t m_spins = 1;
+};
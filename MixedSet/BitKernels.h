@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "Simd.h"
+
+enum class SetOperation
+{
+	Union,
+	Intersection,
+	Difference,
+	SymmetricDifference,
+};
+
+// Word-wise kernels working on the storage of bit vectors.
+// They use plain loads and stores, so the words must not be
+// modified concurrently.
+namespace BitKernels
+{
+	using Word = uint64_t;
+
+	template<SetOperation Op>
+	Word combine_word(Word lhs, Word rhs)
+	{
+		if constexpr (Op == SetOperation::Union)
+			return lhs | rhs;
+		else if constexpr (Op == SetOperation::Intersection)
+			return lhs & rhs;
+		else if constexpr (Op == SetOperation::Difference)
+			return lhs & ~rhs;
+		else
+			return lhs ^ rhs;
+	}
+
+	template<SetOperation Op>
+	void combine_scalar(const Word* lhs, const Word* rhs, Word* out, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			out[i] = combine_word<Op>(lhs[i], rhs[i]);
+	}
+
+#ifdef MIXEDSET_X86
+	template<SetOperation Op>
+	MIXEDSET_TARGET("avx2")
+	__m256i combine_vector(__m256i a, __m256i b)
+	{
+		if constexpr (Op == SetOperation::Union)
+			return _mm256_or_si256(a, b);
+		else if constexpr (Op == SetOperation::Intersection)
+			return _mm256_and_si256(a, b);
+		else if constexpr (Op == SetOperation::Difference)
+			return _mm256_andnot_si256(b, a);
+		else
+			return _mm256_xor_si256(a, b);
+	}
+
+	// _mm512_andnot_si512 merges into an undefined vector, which GCC warns
+	// about, so the difference uses the zero-masked form
+	template<SetOperation Op>
+	MIXEDSET_TARGET("avx512f")
+	__m512i combine_vector(__m512i a, __m512i b)
+	{
+		if constexpr (Op == SetOperation::Union)
+			return _mm512_or_si512(a, b);
+		else if constexpr (Op == SetOperation::Intersection)
+			return _mm512_and_si512(a, b);
+		else if constexpr (Op == SetOperation::Difference)
+			return _mm512_maskz_andnot_epi64(0xff, b, a);
+		else
+			return _mm512_xor_si512(a, b);
+	}
+
+	template<SetOperation Op>
+	MIXEDSET_TARGET("avx2")
+	void combine_avx2(const Word* lhs, const Word* rhs, Word* out, size_t count)
+	{
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lhs + i));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rhs + i));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), combine_vector<Op>(a, b));
+		}
+
+		combine_scalar<Op>(lhs + i, rhs + i, out + i, count - i);
+	}
+
+	template<SetOperation Op>
+	MIXEDSET_TARGET("avx512f")
+	void combine_avx512(const Word* lhs, const Word* rhs, Word* out, size_t count)
+	{
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			__m512i a = _mm512_loadu_si512(lhs + i);
+			__m512i b = _mm512_loadu_si512(rhs + i);
+			_mm512_storeu_si512(out + i, combine_vector<Op>(a, b));
+		}
+
+		combine_scalar<Op>(lhs + i, rhs + i, out + i, count - i);
+	}
+#endif
+
+	// out[i] = lhs[i] Op rhs[i] for i in [0, count), using the widest
+	// vector instructions the CPU supports. 'out' may be the same as 'lhs' or 'rhs'.
+	template<SetOperation Op>
+	void combine(const std::atomic<Word>* lhs, const std::atomic<Word>* rhs, std::atomic<Word>* out, size_t count)
+	{
+		const auto* a = reinterpret_cast<const Word*>(lhs);
+		const auto* b = reinterpret_cast<const Word*>(rhs);
+		auto* result = reinterpret_cast<Word*>(out);
+
+#ifdef MIXEDSET_X86
+		if (Simd::cpu_features().avx512)
+			return combine_avx512<Op>(a, b, result, count);
+		if (Simd::cpu_features().avx2)
+			return combine_avx2<Op>(a, b, result, count);
+#endif
+		combine_scalar<Op>(a, b, result, count);
+	}
+}
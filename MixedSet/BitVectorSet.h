@@ -1,34 +1,171 @@
 #pragma once
+#include <algorithm>
 #include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <utility>
 #include <vector>
+#include "BitKernels.h"
+#include "ConcurrencyPolicy.h"
+#include "PageAllocation.h"
+#include "Simd.h"
 
+// Memory ordering policies for BitVectorSet.
+// 'load' is used by contains, 'modify' by the read-modify-write
+// operations of insert and erase.
+struct RelaxedOrdering
+{
+	static constexpr std::memory_order load = std::memory_order_relaxed;
+	static constexpr std::memory_order modify = std::memory_order_relaxed;
+};
+
+// Publishes the modifications, but lookups are not synchronized with them.
+struct ReleaseOrdering
+{
+	static constexpr std::memory_order load = std::memory_order_relaxed;
+	static constexpr std::memory_order modify = std::memory_order_release;
+};
+
+struct AcquireReleaseOrdering
+{
+	static constexpr std::memory_order load = std::memory_order_acquire;
+	static constexpr std::memory_order modify = std::memory_order_acq_rel;
+};
+
+struct SequentialOrdering
+{
+	static constexpr std::memory_order load = std::memory_order_seq_cst;
+	static constexpr std::memory_order modify = std::memory_order_seq_cst;
+};
+
+template<
+	typename Ordering = ReleaseOrdering,
+	typename Concurrency = ConcurrencyPolicy::Concurrent
+>
 class BitVectorSet
 {
+	using Word = uint64_t;
+	static constexpr size_t c_wordBits = 64;
+
+	// The words live in zero-filled pages, which are only valid atomics if they have no extra state
+	static_assert(sizeof(std::atomic<Word>) == sizeof(Word) && std::atomic<Word>::is_always_lock_free);
+
 public:
-	BitVectorSet(size_t size) : m_data((size + 7) / 8), m_size(size)
+	// The storage comes zeroed from the OS and is not touched here,
+	// so construction is cheap regardless of the size.
+	BitVectorSet(size_t size, AllocationPolicy policy = {})
+		: m_storage(word_count(size) * sizeof(Word), policy),
+		m_summaryStorage(word_count(word_count(size)) * sizeof(Word), policy),
+		m_dirtyStorage(word_count(dirty_page_count(size)) * sizeof(Word)),
+		m_data(static_cast<std::atomic<Word>*>(m_storage.data())),
+		m_summary(static_cast<std::atomic<Word>*>(m_summaryStorage.data())),
+		m_dirty(static_cast<std::atomic<Word>*>(m_dirtyStorage.data())),
+		m_size(size)
 	{
 	}
 
+	// Size of the user data stored in the header of set files
+	static constexpr size_t c_fileParameterBytes = 256;
+
+	// Creates a set backed by the file at 'path', replacing the file.
+	// 'parameters' are stored in the header, so that the user of the
+	// set can check them on reopening, e.g. that the linearizer is the same.
+	// The file is sparse, so it only takes space for the used pages.
+	static BitVectorSet create_file(const std::filesystem::path& path, size_t size, std::span<const std::byte> parameters = {})
+	{
+		if (parameters.size() > c_fileParameterBytes)
+			throw std::invalid_argument("Too many file parameters");
+
+		MappedFile file(path, MappedFile::Mode::Create, file_summary_offset(size) + file_section_bytes(word_count(word_count(size)) * sizeof(Word)));
+		PageAllocation header(file, 0, sizeof(FileHeader));
+
+		auto* fileHeader = new (header.data()) FileHeader{};
+		std::memcpy(fileHeader->magic, c_fileMagic, sizeof(c_fileMagic));
+		fileHeader->version = c_fileVersion;
+		fileHeader->clean = 1;
+		fileHeader->size = size;
+		std::memcpy(fileHeader->parameters, parameters.data(), parameters.size());
+
+		return BitVectorSet(file, std::move(header));
+	}
+
+	// Opens a file written by create_file. Only the header is read here, the
+	// rest of the file is read lazily when the pages are first accessed, so
+	// the time does not depend on the number of elements. If the file was not
+	// closed properly, the whole file is read to count the elements again.
+	// Throws std::runtime_error if the file is not a set file of this version.
+	static BitVectorSet open_file(const std::filesystem::path& path)
+	{
+		MappedFile file(path, MappedFile::Mode::Open);
+		if (file.size() < file_data_offset())
+			throw std::runtime_error(path.string() + " is not a set file");
+
+		PageAllocation header(file, 0, sizeof(FileHeader));
+		const auto* fileHeader = static_cast<const FileHeader*>(header.data());
+		if (std::memcmp(fileHeader->magic, c_fileMagic, sizeof(c_fileMagic)) != 0)
+			throw std::runtime_error(path.string() + " is not a set file");
+		if (fileHeader->version != c_fileVersion)
+			throw std::runtime_error(path.string() + " has an unsupported version");
+		if (file.size() < file_summary_offset(fileHeader->size) + word_count(word_count(fileHeader->size)) * sizeof(Word))
+			throw std::runtime_error(path.string() + " is truncated");
+
+		return BitVectorSet(file, std::move(header));
+	}
+
+	// File-backed sets are flushed and marked as closed properly
+	~BitVectorSet()
+	{
+		if (m_header && flush())
+		{
+			m_header->clean = 1;
+			m_headerStorage.flush();
+		}
+	}
+
+	// Writes the modifications of a file-backed set to the disk and waits
+	// for it. Returns false if the OS reported an error. Modifications
+	// running concurrently may or may not be written.
+	bool flush()
+	{
+		if (!m_header)
+			return true;
+
+		bool flushed = m_storage.flush() && m_summaryStorage.flush();
+		m_header->count = size();
+		return m_headerStorage.flush() && flushed;
+	}
+
+	// The parameters given to create_file, or an empty span if the set is not file-backed
+	std::span<const std::byte> file_parameters() const
+	{
+		if (!m_header)
+			return {};
+		return m_header->parameters;
+	}
+
 	bool insert(size_t index)
 	{
 		if (index >= m_size)
 			return false;
 
-		auto& byte = m_data[index / 8];
-		uint8_t bitMask = 1 << (index % 8);
+		// A single atomic OR; the previous value tells whether the bit was already set.
+		Word bitMask = bit_mask(index);
+		Word oldValue = Concurrency::fetch_or(word(index), bitMask, Ordering::modify);
 
-		uint8_t oldValue = byte.load(std::memory_order_relaxed);
-		uint8_t newValue = 0;
-		do
-		{
-			if (oldValue & bitMask)
-				return false;
+		if (oldValue & bitMask)
+			return false;
 
-			newValue = oldValue | bitMask;
-		} while (!byte.compare_exchange_strong(oldValue, newValue,
-			std::memory_order_release,
-			std::memory_order_relaxed));
+		if (oldValue == 0)
+			mark_nonempty(index / c_wordBits);
 
+		mark_dirty(index / c_wordBits);
+		m_count.add(1);
 		return true;
 	}
 
@@ -37,38 +174,779 @@ public:
 		if (index >= m_size)
 			return false;
 
-		auto& byte = m_data[index / 8];
-		uint8_t bitMask = 1 << (index % 8);
+		Word bitMask = bit_mask(index);
+		Word oldValue = Concurrency::fetch_and(word(index), ~bitMask, Ordering::modify);
 
-		uint8_t oldValue = byte.load(std::memory_order_relaxed);
-		uint8_t newValue = 0;
-		do
-		{
-			if (!(oldValue & bitMask))
-				return false;
+		if (!(oldValue & bitMask))
+			return false;
 
-			newValue = oldValue & ~bitMask;
-		} while (!byte.compare_exchange_strong(oldValue, newValue,
-			std::memory_order_release,
-			std::memory_order_relaxed));
+		if (oldValue == bitMask)
+			mark_empty(index / c_wordBits);
 
+		mark_dirty(index / c_wordBits);
+		m_count.add(-1);
 		return true;
 	}
 
-	bool contains(size_t index)
+	bool contains(size_t index) const
 	{
 		if (index >= m_size)
 			return false;
 
-		auto& byte = m_data[index / 8];
-		uint8_t bitMask = 1 << (index % 8);
+		return word(index).load(Ordering::load) & bit_mask(index);
+	}
+
+	// Inserts every index in [begin, end), and returns how many of them were not in the set.
+	// Inner words are written with a single atomic exchange each.
+	size_t set_range(size_t begin, size_t end)
+	{
+		return modify_range(begin, end, true);
+	}
+
+	// Erases every index in [begin, end), and returns how many of them were in the set.
+	size_t clear_range(size_t begin, size_t end)
+	{
+		return modify_range(begin, end, false);
+	}
+
+	// Erases every element. The storage is released to the OS, so the
+	// cost does not depend on how much of it was used. Must not run
+	// concurrently with any other operation.
+	void clear()
+	{
+		for_each_nonempty_word([this](size_t wordIdx)
+		{
+			mark_dirty(wordIdx);
+		});
+
+		m_storage.clear();
+		m_summaryStorage.clear();
+		m_count.reset();
+		m_rankBlocks.clear();
+	}
+
+	// Size of the units in which changes are tracked for incremental checkpoints
+	static constexpr size_t c_dirtyPageBytes = 4096;
+
+	// Returns the pages changed since the previous call (or the construction),
+	// in increasing order, and marks them clean. Pages changed while this
+	// runs are reported either by this or by the next call.
+	std::vector<size_t> collect_dirty()
+	{
+		std::vector<size_t> pages;
+		const size_t dirtyWords = word_count(dirty_page_count(m_size));
+
+		for (size_t i = 0; i < dirtyWords; i++)
+		{
+			if (m_dirty[i].load(std::memory_order_relaxed) == 0)
+				continue;
+
+			for (Word bits = Concurrency::exchange(m_dirty[i], Word{ 0 }, std::memory_order_acq_rel); bits; bits &= bits - 1)
+				pages.push_back(i * c_wordBits + std::countr_zero(bits));
+		}
+
+		return pages;
+	}
+
+	// The words of a page returned by collect_dirty, which can be written to
+	// the checkpoint. The last page may be shorter than the others.
+	std::span<const uint64_t> page_words(size_t page) const
+	{
+		const size_t first = page * c_dirtyPageWords;
+		const size_t count = std::min(c_dirtyPageWords, word_count(m_size) - first);
+		return { reinterpret_cast<const uint64_t*>(m_data + first), count };
+	}
+
+	// Number of elements
+	size_t size() const
+	{
+		// The shards can be transiently negative while an erase races with the insert of the same element
+		return static_cast<size_t>(std::max<std::ptrdiff_t>(m_count.load(), 0));
+	}
+
+	// Number of possible elements, which are the indices in [0, capacity())
+	size_t capacity() const
+	{
+		return m_size;
+	}
+
+	// Precomputes the number of elements before every block of c_rankBlockBits
+	// bits, which makes rank and select constant and logarithmic time.
+	// The index is a snapshot: the set must not be modified while rank
+	// or select is used, and the index has to be rebuilt after modifications.
+	void build_rank_index()
+	{
+		const size_t wordCount = word_count(m_size);
+		const size_t blockCount = (wordCount + c_rankBlockWords - 1) / c_rankBlockWords;
+
+		m_rankBlocks.assign(blockCount + 1, 0);
+		for (size_t block = 0; block < blockCount; block++)
+		{
+			size_t count = 0;
+			for (size_t w = block * c_rankBlockWords; w < std::min(wordCount, (block + 1) * c_rankBlockWords); w++)
+				count += std::popcount(m_data[w].load(std::memory_order_relaxed));
+
+			m_rankBlocks[block + 1] = m_rankBlocks[block] + count;
+		}
+	}
+
+	// Number of elements less than 'index'. Requires build_rank_index().
+	size_t rank(size_t index) const
+	{
+		assert(!m_rankBlocks.empty());
+		index = std::min(index, m_size);
+
+		size_t wordIdx = index / c_wordBits;
+		size_t block = wordIdx / c_rankBlockWords;
+		size_t count = m_rankBlocks[block];
+
+		for (size_t w = block * c_rankBlockWords; w < wordIdx; w++)
+			count += std::popcount(m_data[w].load(std::memory_order_relaxed));
 
-		uint8_t oldValue = byte.load(std::memory_order_relaxed);
+		if (index % c_wordBits)
+			count += std::popcount(m_data[wordIdx].load(std::memory_order_relaxed) & (bit_mask(index) - 1));
 
-		return oldValue & bitMask;
+		return count;
 	}
 
+	// The element with the given rank, i.e. the (n+1)th smallest one.
+	// Requires build_rank_index().
+	std::optional<size_t> select(size_t n) const
+	{
+		assert(!m_rankBlocks.empty());
+		if (n >= m_rankBlocks.back())
+			return std::nullopt;
+
+		// The last block starting with at most n elements before it
+		auto blockIter = std::upper_bound(m_rankBlocks.begin(), m_rankBlocks.end(), n) - 1;
+		size_t remaining = n - *blockIter;
+
+		for (size_t w = (blockIter - m_rankBlocks.begin()) * c_rankBlockWords; ; w++)
+		{
+			Word bits = m_data[w].load(std::memory_order_relaxed);
+			size_t count = std::popcount(bits);
+			if (remaining < count)
+			{
+				for (; remaining > 0; remaining--)
+					bits &= bits - 1;
+
+				return w * c_wordBits + std::countr_zero(bits);
+			}
+
+			remaining -= count;
+		}
+	}
+
+	// Returns the smallest element which is not less than 'index'.
+	// Empty words are skipped using the summary, so the cost depends
+	// on the number of elements rather than on the size of the set.
+	std::optional<size_t> find_next(size_t index) const
+	{
+		if (index >= m_size)
+			return std::nullopt;
+
+		size_t wordIdx = index / c_wordBits;
+		Word bits = m_data[wordIdx].load(Ordering::load) & (~Word{ 0 } << (index % c_wordBits));
+
+		while (!bits)
+		{
+			wordIdx = next_nonempty_word(wordIdx + 1);
+			if (wordIdx == word_count(m_size))
+				return std::nullopt;
+
+			// The summary may be stale under concurrent erases
+			bits = m_data[wordIdx].load(Ordering::load);
+		}
+
+		return wordIdx * c_wordBits + std::countr_zero(bits);
+	}
+
+	// Calls 'f' with every element in increasing order. Under concurrent
+	// modification, elements inserted or erased during the call may or
+	// may not be reported.
+	template<typename F>
+	void for_each(F&& f) const
+	{
+		const size_t summaryWords = word_count(word_count(m_size));
+		for (size_t summaryIdx = 0; summaryIdx < summaryWords; summaryIdx++)
+		{
+			Word nonempty = m_summary[summaryIdx].load(std::memory_order_acquire);
+			while (nonempty)
+			{
+				size_t wordIdx = summaryIdx * c_wordBits + std::countr_zero(nonempty);
+				nonempty &= nonempty - 1;
+
+				Word bits = m_data[wordIdx].load(Ordering::load);
+				while (bits)
+				{
+					f(wordIdx * c_wordBits + std::countr_zero(bits));
+					bits &= bits - 1;
+				}
+			}
+		}
+	}
+
+	// The part of the requested allocation policy that took effect
+	const AllocationPolicy& allocation_policy() const
+	{
+		return m_storage.policy();
+	}
+
+	// Set operations with another set of the same capacity, which modify this set.
+	// Only the elements in [begin, end) are affected, so that disjoint ranges can be
+	// processed by different threads; the bounds must be multiples of c_rangeAlignment,
+	// except that 'end' may be the capacity. Neither set may be modified concurrently
+	// in the range, and the rank index has to be rebuilt afterwards.
+	void union_with(const BitVectorSet& other, size_t begin = 0, size_t end = SIZE_MAX)
+	{
+		assign(SetOperation::Union, *this, other, begin, end);
+	}
+
+	void intersect_with(const BitVectorSet& other, size_t begin = 0, size_t end = SIZE_MAX)
+	{
+		assign(SetOperation::Intersection, *this, other, begin, end);
+	}
+
+	void subtract(const BitVectorSet& other, size_t begin = 0, size_t end = SIZE_MAX)
+	{
+		assign(SetOperation::Difference, *this, other, begin, end);
+	}
+
+	void xor_with(const BitVectorSet& other, size_t begin = 0, size_t end = SIZE_MAX)
+	{
+		assign(SetOperation::SymmetricDifference, *this, other, begin, end);
+	}
+
+	// Out-of-place version of the set operations: in the range
+	// [begin, end), this set becomes the result of 'lhs op rhs'.
+	void assign(SetOperation op, const BitVectorSet& lhs, const BitVectorSet& rhs, size_t begin = 0, size_t end = SIZE_MAX)
+	{
+		assert(lhs.capacity() == m_size && rhs.capacity() == m_size);
+		end = std::min(end, m_size);
+		assert(begin % c_rangeAlignment == 0 && (end % c_rangeAlignment == 0 || end == m_size));
+
+		switch (op)
+		{
+		case SetOperation::Union:
+			return combine<SetOperation::Union>(lhs, rhs, begin, end);
+		case SetOperation::Intersection:
+			return combine<SetOperation::Intersection>(lhs, rhs, begin, end);
+		case SetOperation::Difference:
+			return combine<SetOperation::Difference>(lhs, rhs, begin, end);
+		case SetOperation::SymmetricDifference:
+			return combine<SetOperation::SymmetricDifference>(lhs, rhs, begin, end);
+		}
+	}
+
+	// Batched versions of insert, erase and contains.
+	// Bit i of 'result' is set to the return value of the single element
+	// call for indices[i]; 'result' must hold at least mask_words(indices.size()) words.
+	void insert_many(std::span<const size_t> indices, std::span<uint64_t> result)
+	{
+		modify_many(indices, result, [this](size_t index)
+		{
+			return insert(index);
+		});
+	}
+
+	void erase_many(std::span<const size_t> indices, std::span<uint64_t> result)
+	{
+		modify_many(indices, result, [this](size_t index)
+		{
+			return erase(index);
+		});
+	}
+
+	void contains_many(std::span<const size_t> indices, std::span<uint64_t> result) const
+	{
+		assert(result.size() >= mask_words(indices.size()));
+		std::fill_n(result.begin(), mask_words(indices.size()), 0);
+
+#ifdef MIXEDSET_X86
+		if (sizeof(size_t) == sizeof(Word) && Simd::cpu_features().avx2)
+			contains_many_avx2(m_data, m_size, indices.data(), indices.size(), result.data());
+		else
+#endif
+			contains_many_scalar(m_data, m_size, indices.data(), 0, indices.size(), result.data());
+
+		// The kernels read the words with plain loads
+		if constexpr (Ordering::load != std::memory_order_relaxed)
+			std::atomic_thread_fence(std::memory_order_acquire);
+	}
+
+	static constexpr size_t mask_words(size_t count)
+	{
+		return word_count(count);
+	}
+
+	// The unit of the write combining, one cache line of words
+	static constexpr size_t c_lineWords = 64 / sizeof(Word);
+	static constexpr size_t c_lineBits = c_lineWords * c_wordBits;
+
+	// Collects the inserts of one thread which fall into the same cache line,
+	// and applies them with one atomic OR per word when the thread moves on
+	// to another line, so that threads inserting nearby elements do not take
+	// the line from each other for every element. The inserts are not visible
+	// to the other threads until they are flushed.
+	class WriteCombiner
+	{
+	public:
+		explicit WriteCombiner(BitVectorSet& set)
+			: m_set(set)
+		{
+		}
+
+		WriteCombiner(const WriteCombiner&) = delete;
+		WriteCombiner& operator=(const WriteCombiner&) = delete;
+
+		~WriteCombiner()
+		{
+			flush();
+		}
+
+		// Returns false if the index is out of range. Whether the element
+		// is new is only known when it is flushed.
+		bool insert(size_t index)
+		{
+			if (index >= m_set.m_size)
+				return false;
+
+			size_t line = index / c_lineBits;
+			if (line != m_line)
+			{
+				flush_line();
+				m_line = line;
+			}
+
+			m_bits[index % c_lineBits / c_wordBits] |= bit_mask(index);
+			return true;
+		}
+
+		// Applies the pending inserts to the set, and returns how many new
+		// elements were inserted since the previous flush, including the
+		// lines flushed by insert. They are published with the ordering of insert.
+		size_t flush()
+		{
+			flush_line();
+			return std::exchange(m_inserted, 0);
+		}
+
+	private:
+		static constexpr size_t c_noLine = SIZE_MAX;
+
+		void flush_line()
+		{
+			if (m_line == c_noLine)
+				return;
+
+			m_inserted += m_set.insert_words(m_line * c_lineWords, m_bits, c_lineWords);
+			std::fill(std::begin(m_bits), std::end(m_bits), 0);
+			m_line = c_noLine;
+		}
+
+		BitVectorSet& m_set;
+		size_t m_line = c_noLine;
+		size_t m_inserted = 0;
+		Word m_bits[c_lineWords] = {};
+	};
+
+	// Bits per block of the rank index, one cache line of words
+	static constexpr size_t c_rankBlockBits = 512;
+
+	// Granularity of the ranges of the set operations: the bits covered by one summary word
+	static constexpr size_t c_rangeAlignment = c_wordBits * c_wordBits;
+
 private:
-	std::vector<std::atomic<uint8_t>> m_data;
+	static constexpr size_t c_rankBlockWords = c_rankBlockBits / c_wordBits;
+
+	// Sets the given bits in 'count' words starting at 'firstWord', which is
+	// within the set, and returns how many of them were not set before
+	size_t insert_words(size_t firstWord, const Word* bits, size_t count)
+	{
+		count = std::min(count, word_count(m_size) - firstWord);
+
+		size_t inserted = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!bits[i])
+				continue;
+
+			const size_t wordIdx = firstWord + i;
+			Word oldValue = Concurrency::fetch_or(m_data[wordIdx], bits[i], Ordering::modify);
+			if (oldValue == 0)
+				mark_nonempty(wordIdx);
+
+			if (size_t newBits = std::popcount(bits[i] & ~oldValue))
+			{
+				mark_dirty(wordIdx);
+				inserted += newBits;
+			}
+		}
+
+		m_count.add(static_cast<std::ptrdiff_t>(inserted));
+		return inserted;
+	}
+
+	// How many elements ahead the batched operations prefetch the target words
+	static constexpr size_t c_prefetchDistance = 16;
+
+	template<typename F>
+	void modify_many(std::span<const size_t> indices, std::span<uint64_t> result, F&& modify)
+	{
+		assert(result.size() >= mask_words(indices.size()));
+		std::fill_n(result.begin(), mask_words(indices.size()), 0);
+
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			if (i + c_prefetchDistance < indices.size() && indices[i + c_prefetchDistance] < m_size)
+				Simd::prefetch_for_write(&word(indices[i + c_prefetchDistance]));
+
+			if (modify(indices[i]))
+				result[i / c_wordBits] |= Word{ 1 } << (i % c_wordBits);
+		}
+	}
+
+	static void contains_many_scalar(const std::atomic<Word>* data, size_t size,
+		const size_t* indices, size_t first, size_t count, uint64_t* result)
+	{
+		for (size_t i = first; i < count; i++)
+		{
+			if (i + c_prefetchDistance < count && indices[i + c_prefetchDistance] < size)
+				Simd::prefetch(data + indices[i + c_prefetchDistance] / c_wordBits);
+
+			size_t index = indices[i];
+			if (index < size && (data[index / c_wordBits].load(std::memory_order_relaxed) & bit_mask(index)))
+				result[i / c_wordBits] |= Word{ 1 } << (i % c_wordBits);
+		}
+	}
+
+#ifdef MIXEDSET_X86
+	// Tests four indices at a time: gathers their words, shifts the
+	// addressed bits to the sign position and collects them with movemask.
+	MIXEDSET_TARGET("avx2")
+	static void contains_many_avx2(const std::atomic<Word>* data, size_t size,
+		const size_t* indices, size_t count, uint64_t* result)
+	{
+		const auto* base = reinterpret_cast<const long long*>(data);
+
+		// AVX2 only has a signed 64-bit comparison, so the range check is done with flipped sign bits
+		const __m256i signBit = _mm256_set1_epi64x(INT64_MIN);
+		const __m256i limit = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(size)), signBit);
+		const __m256i bitIndexMask = _mm256_set1_epi64x(c_wordBits - 1);
+
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			for (size_t j = i + c_prefetchDistance; j < i + c_prefetchDistance + 4 && j < count; j++)
+			{
+				if (indices[j] < size)
+					Simd::prefetch(data + indices[j] / c_wordBits);
+			}
+
+			__m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i));
+			__m256i inRange = _mm256_cmpgt_epi64(limit, _mm256_xor_si256(index, signBit));
+			__m256i words = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), base,
+				_mm256_srli_epi64(index, 6), inRange, 8);
+			__m256i bits = _mm256_slli_epi64(_mm256_srlv_epi64(words, _mm256_and_si256(index, bitIndexMask)), 63);
+
+			Word found = static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(bits)));
+			result[i / c_wordBits] |= found << (i % c_wordBits);
+		}
+
+		contains_many_scalar(data, size, indices, i, count, result);
+	}
+#endif
+
+	size_t modify_range(size_t begin, size_t end, bool set)
+	{
+		end = std::min(end, m_size);
+		if (begin >= end)
+			return 0;
+
+		const size_t firstWord = begin / c_wordBits;
+		const size_t lastWord = (end - 1) / c_wordBits;
+		size_t changed = 0;
+
+		// Summary changes are collected and applied once per summary word
+		Word summaryChanges = 0;
+		auto flushSummary = [&](size_t wordIdx)
+		{
+			if (set)
+				mark_nonempty_words(wordIdx / c_wordBits, summaryChanges);
+			else
+				mark_empty_words(wordIdx / c_wordBits, summaryChanges);
+			summaryChanges = 0;
+		};
+
+		for (size_t w = firstWord; w <= lastWord; w++)
+		{
+			Word mask = ~Word{ 0 };
+			if (w == firstWord)
+				mask &= ~Word{ 0 } << (begin % c_wordBits);
+			if (w == lastWord && end % c_wordBits)
+				mask &= ~Word{ 0 } >> (c_wordBits - end % c_wordBits);
+
+			Word oldValue;
+			if (set)
+			{
+				oldValue = mask == ~Word{ 0 }
+					? Concurrency::exchange(m_data[w], mask, Ordering::modify)
+					: Concurrency::fetch_or(m_data[w], mask, Ordering::modify);
+				changed += std::popcount(~oldValue & mask);
+				if (oldValue == 0)
+					summaryChanges |= bit_mask(w);
+				if (~oldValue & mask)
+					mark_dirty(w);
+			}
+			else
+			{
+				oldValue = mask == ~Word{ 0 }
+					? Concurrency::exchange(m_data[w], Word{ 0 }, Ordering::modify)
+					: Concurrency::fetch_and(m_data[w], ~mask, Ordering::modify);
+				changed += std::popcount(oldValue & mask);
+				if (oldValue != 0 && (oldValue & ~mask) == 0)
+					summaryChanges |= bit_mask(w);
+				if (oldValue & mask)
+					mark_dirty(w);
+			}
+
+			if (w % c_wordBits == c_wordBits - 1)
+				flushSummary(w);
+		}
+		flushSummary(lastWord);
+
+		m_count.add(set ? static_cast<std::ptrdiff_t>(changed) : -static_cast<std::ptrdiff_t>(changed));
+		return changed;
+	}
+
+	// Processes the range one summary word at a time, so that the
+	// bookkeeping of the block happens while it is still in the cache.
+	template<SetOperation Op>
+	void combine(const BitVectorSet& lhs, const BitVectorSet& rhs, size_t begin, size_t end)
+	{
+		const size_t endWord = word_count(end);
+		std::ptrdiff_t countChange = 0;
+
+		for (size_t block = begin / c_wordBits; block < endWord; block += c_wordBits)
+		{
+			const size_t count = std::min(c_wordBits, endWord - block);
+
+			Word oldWords[c_wordBits];
+			for (size_t i = 0; i < count; i++)
+			{
+				oldWords[i] = m_data[block + i].load(std::memory_order_relaxed);
+				countChange -= std::popcount(oldWords[i]);
+			}
+
+			BitKernels::combine<Op>(lhs.m_data + block, rhs.m_data + block, m_data + block, count);
+
+			Word nonempty = 0;
+			bool changed = false;
+			for (size_t i = 0; i < count; i++)
+			{
+				Word bits = m_data[block + i].load(std::memory_order_relaxed);
+				countChange += std::popcount(bits);
+				changed |= bits != oldWords[i];
+				if (bits)
+					nonempty |= bit_mask(i);
+			}
+
+			m_summary[block / c_wordBits].store(nonempty, std::memory_order_relaxed);
+
+			// A block is within a single dirty page
+			if (changed)
+				mark_dirty(block);
+		}
+
+		m_count.add(countChange);
+	}
+
+	// Layout of set files: the header, then the words, then the summary,
+	// each starting at a multiple of the section alignment
+	struct FileHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t clean; // the file was closed after the last modification, so 'count' is valid
+		uint64_t size;
+		uint64_t count;
+		std::byte parameters[c_fileParameterBytes];
+	};
+
+	static constexpr char c_fileMagic[8] = { 'B', 'I', 'T', 'V', 'S', 'E', 'T', '\0' };
+	static constexpr uint32_t c_fileVersion = 1;
+
+	static constexpr size_t file_section_bytes(size_t bytes)
+	{
+		return (bytes + MappedFile::c_sectionAlignment - 1) / MappedFile::c_sectionAlignment * MappedFile::c_sectionAlignment;
+	}
+
+	static constexpr size_t file_data_offset()
+	{
+		return file_section_bytes(sizeof(FileHeader));
+	}
+
+	static constexpr size_t file_summary_offset(size_t size)
+	{
+		return file_data_offset() + file_section_bytes(word_count(size) * sizeof(Word));
+	}
+
+	BitVectorSet(const MappedFile& file, PageAllocation header)
+		: m_headerStorage(std::move(header)),
+		m_storage(file, file_data_offset(), word_count(file_header().size) * sizeof(Word)),
+		m_summaryStorage(file, file_summary_offset(file_header().size), word_count(word_count(file_header().size)) * sizeof(Word)),
+		m_dirtyStorage(word_count(dirty_page_count(file_header().size)) * sizeof(Word)),
+		m_header(static_cast<FileHeader*>(m_headerStorage.data())),
+		m_data(static_cast<std::atomic<Word>*>(m_storage.data())),
+		m_summary(static_cast<std::atomic<Word>*>(m_summaryStorage.data())),
+		m_dirty(static_cast<std::atomic<Word>*>(m_dirtyStorage.data())),
+		m_size(file_header().size)
+	{
+		if (m_header->clean)
+		{
+			m_count.add(static_cast<std::ptrdiff_t>(m_header->count));
+		}
+		else
+		{
+			// The summary could have been written back without some of the words, so it is rebuilt
+			const size_t wordCount = word_count(m_size);
+			for (size_t summaryIdx = 0; summaryIdx < word_count(wordCount); summaryIdx++)
+			{
+				Word nonempty = 0;
+				for (size_t wordIdx = summaryIdx * c_wordBits; wordIdx < std::min(wordCount, (summaryIdx + 1) * c_wordBits); wordIdx++)
+				{
+					Word bits = m_data[wordIdx].load(std::memory_order_relaxed);
+					m_count.add(std::popcount(bits));
+					if (bits)
+						nonempty |= bit_mask(wordIdx);
+				}
+				m_summary[summaryIdx].store(nonempty, std::memory_order_relaxed);
+			}
+		}
+
+		// Until it is closed, a crash could leave the file with any of the modifications
+		m_header->clean = 0;
+		m_headerStorage.flush();
+	}
+
+	const FileHeader& file_header() const
+	{
+		return *static_cast<const FileHeader*>(m_headerStorage.data());
+	}
+
+	static constexpr size_t c_dirtyPageWords = c_dirtyPageBytes / sizeof(Word);
+
+	static constexpr size_t dirty_page_count(size_t bits)
+	{
+		return (word_count(bits) + c_dirtyPageWords - 1) / c_dirtyPageWords;
+	}
+
+	// Called after the write of the word. The release read-modify-write is
+	// done even if the page is dirty already: collect_dirty may be clearing
+	// the bit at the same time, and its exchange has to synchronize with this,
+	// so that it either reads the new data or leaves the bit for the next call.
+	void mark_dirty(size_t wordIdx)
+	{
+		size_t page = wordIdx / c_dirtyPageWords;
+		Concurrency::fetch_or(m_dirty[page / c_wordBits], bit_mask(page), std::memory_order_release);
+	}
+
+	template<typename F>
+	void for_each_nonempty_word(F&& f) const
+	{
+		for (size_t wordIdx = next_nonempty_word(0); wordIdx < word_count(m_size); wordIdx = next_nonempty_word(wordIdx + 1))
+			f(wordIdx);
+	}
+
+	// The summary has a bit for each word, which is set iff the word is not empty.
+	// An insert which makes a word non-empty sets the bit after the word is
+	// changed. An erase which empties a word clears the bit, then checks the
+	// word again, because an insert might have raced with it.
+	void mark_nonempty(size_t wordIdx)
+	{
+		mark_nonempty_words(wordIdx / c_wordBits, bit_mask(wordIdx));
+	}
+
+	void mark_empty(size_t wordIdx)
+	{
+		mark_empty_words(wordIdx / c_wordBits, bit_mask(wordIdx));
+	}
+
+	// The same for the words of the given summary word which are in 'words'
+	void mark_nonempty_words(size_t summaryIdx, Word words)
+	{
+		if (words)
+			Concurrency::fetch_or(m_summary[summaryIdx], words, std::memory_order_release);
+	}
+
+	void mark_empty_words(size_t summaryIdx, Word words)
+	{
+		if (!words)
+			return;
+
+		Concurrency::fetch_and(m_summary[summaryIdx], ~words, std::memory_order_acq_rel);
+
+		Word refilled = 0;
+		for (; words; words &= words - 1)
+		{
+			size_t wordIdx = summaryIdx * c_wordBits + std::countr_zero(words);
+			if (m_data[wordIdx].load(std::memory_order_relaxed) != 0)
+				refilled |= bit_mask(wordIdx);
+		}
+		mark_nonempty_words(summaryIdx, refilled);
+	}
+
+	// Returns the first word at or after 'wordIdx' which is marked in the summary,
+	// or the number of words if there is none
+	size_t next_nonempty_word(size_t wordIdx) const
+	{
+		const size_t wordCount = word_count(m_size);
+		if (wordIdx >= wordCount)
+			return wordCount;
+
+		size_t summaryIdx = wordIdx / c_wordBits;
+		Word nonempty = m_summary[summaryIdx].load(std::memory_order_acquire) & (~Word{ 0 } << (wordIdx % c_wordBits));
+
+		while (!nonempty)
+		{
+			if (++summaryIdx >= word_count(wordCount))
+				return wordCount;
+
+			nonempty = m_summary[summaryIdx].load(std::memory_order_acquire);
+		}
+
+		return summaryIdx * c_wordBits + std::countr_zero(nonempty);
+	}
+
+	static constexpr size_t word_count(size_t bits)
+	{
+		return (bits + c_wordBits - 1) / c_wordBits;
+	}
+
+	static Word bit_mask(size_t index)
+	{
+		return Word{ 1 } << (index % c_wordBits);
+	}
+
+	std::atomic<Word>& word(size_t index)
+	{
+		return m_data[index / c_wordBits];
+	}
+
+	const std::atomic<Word>& word(size_t index) const
+	{
+		return m_data[index / c_wordBits];
+	}
+
+	PageAllocation m_headerStorage;
+	PageAllocation m_storage;
+	PageAllocation m_summaryStorage;
+	PageAllocation m_dirtyStorage;
+	FileHeader* m_header = nullptr;
+	std::atomic<Word>* m_data;
+	std::atomic<Word>* m_summary;
+	std::atomic<Word>* m_dirty;
 	size_t m_size;
-};
\ No newline at end of file
+	typename Concurrency::Counter m_count;
+	std::vector<size_t> m_rankBlocks;
+};
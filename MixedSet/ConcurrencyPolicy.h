@@ -0,0 +1,170 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <shared_mutex>
+#include "ShardedCounter.h"
+
+// A mutex which does nothing, for containers used by a single thread
+struct NullMutex
+{
+	void lock() {}
+	bool try_lock() { return true; }
+	void unlock() {}
+	void lock_shared() {}
+	bool try_lock_shared() { return true; }
+	void unlock_shared() {}
+};
+
+// A counter for containers used by a single thread
+class PlainCounter
+{
+public:
+	static constexpr std::ptrdiff_t c_maxError = 0;
+
+	void add(std::ptrdiff_t delta)
+	{
+		m_value += delta;
+	}
+
+	std::ptrdiff_t load() const
+	{
+		return m_value;
+	}
+
+	std::ptrdiff_t approximate() const
+	{
+		return m_value;
+	}
+
+	void reset()
+	{
+		m_value = 0;
+	}
+
+private:
+	std::ptrdiff_t m_value = 0;
+};
+
+// The containers take one of these policies as a template parameter
+// to choose how they synchronize. The atomic read-modify-write helpers
+// are used instead of the member functions of std::atomic, so that the
+// single threaded policy can replace them with plain loads and stores.
+namespace ConcurrencyPolicy
+{
+	// Any number of threads may use the container at the same time
+	struct Concurrent
+	{
+		using Mutex = std::shared_mutex;
+		using Counter = ShardedCounter;
+
+		template<typename T>
+		static T fetch_or(std::atomic<T>& atomic, T value, std::memory_order order = std::memory_order_seq_cst)
+		{
+			return atomic.fetch_or(value, order);
+		}
+
+		template<typename T>
+		static T fetch_and(std::atomic<T>& atomic, T value, std::memory_order order = std::memory_order_seq_cst)
+		{
+			return atomic.fetch_and(value, order);
+		}
+
+		template<typename T>
+		static T fetch_add(std::atomic<T>& atomic, T value, std::memory_order order = std::memory_order_seq_cst)
+		{
+			return atomic.fetch_add(value, order);
+		}
+
+		template<typename T>
+		static T fetch_sub(std::atomic<T>& atomic, T value, std::memory_order order = std::memory_order_seq_cst)
+		{
+			return atomic.fetch_sub(value, order);
+		}
+
+		template<typename T>
+		static T exchange(std::atomic<T>& atomic, T value, std::memory_order order = std::memory_order_seq_cst)
+		{
+			return atomic.exchange(value, order);
+		}
+
+		template<typename T>
+		static bool compare_exchange_weak(std::atomic<T>& atomic, T& expected, T desired, std::memory_order order = std::memory_order_seq_cst)
+		{
+			return atomic.compare_exchange_weak(expected, desired, order, std::memory_order_relaxed);
+		}
+
+		// The failure ordering is derived from 'order', as the loaded value may be used
+		template<typename T>
+		static bool compare_exchange_strong(std::atomic<T>& atomic, T& expected, T desired, std::memory_order order = std::memory_order_seq_cst)
+		{
+			return atomic.compare_exchange_strong(expected, desired, order);
+		}
+	};
+
+	// Only one thread uses the container at a time, so all synchronization is compiled away
+	struct Single
+	{
+		using Mutex = NullMutex;
+		using Counter = PlainCounter;
+
+		template<typename T>
+		static T fetch_or(std::atomic<T>& atomic, T value, std::memory_order = std::memory_order_seq_cst)
+		{
+			T oldValue = atomic.load(std::memory_order_relaxed);
+			atomic.store(oldValue | value, std::memory_order_relaxed);
+			return oldValue;
+		}
+
+		template<typename T>
+		static T fetch_and(std::atomic<T>& atomic, T value, std::memory_order = std::memory_order_seq_cst)
+		{
+			T oldValue = atomic.load(std::memory_order_relaxed);
+			atomic.store(oldValue & value, std::memory_order_relaxed);
+			return oldValue;
+		}
+
+		template<typename T>
+		static T fetch_add(std::atomic<T>& atomic, T value, std::memory_order = std::memory_order_seq_cst)
+		{
+			T oldValue = atomic.load(std::memory_order_relaxed);
+			atomic.store(oldValue + value, std::memory_order_relaxed);
+			return oldValue;
+		}
+
+		template<typename T>
+		static T fetch_sub(std::atomic<T>& atomic, T value, std::memory_order = std::memory_order_seq_cst)
+		{
+			T oldValue = atomic.load(std::memory_order_relaxed);
+			atomic.store(oldValue - value, std::memory_order_relaxed);
+			return oldValue;
+		}
+
+		template<typename T>
+		static T exchange(std::atomic<T>& atomic, T value, std::memory_order = std::memory_order_seq_cst)
+		{
+			T oldValue = atomic.load(std::memory_order_relaxed);
+			atomic.store(value, std::memory_order_relaxed);
+			return oldValue;
+		}
+
+		template<typename T>
+		static bool compare_exchange_weak(std::atomic<T>& atomic, T& expected, T desired, std::memory_order = std::memory_order_seq_cst)
+		{
+			T oldValue = atomic.load(std::memory_order_relaxed);
+			if (oldValue != expected)
+			{
+				expected = oldValue;
+				return false;
+			}
+
+			atomic.store(desired, std::memory_order_relaxed);
+			return true;
+		}
+
+		template<typename T>
+		static bool compare_exchange_strong(std::atomic<T>& atomic, T& expected, T desired, std::memory_order order = std::memory_order_seq_cst)
+		{
+			return compare_exchange_weak(atomic, expected, desired, order);
+		}
+	};
+}
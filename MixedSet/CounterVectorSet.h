@@ -0,0 +1,178 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include "Backoff.h"
+#include "ConcurrencyPolicy.h"
+#include "PageAllocation.h"
+
+// A multiset of the indices in [0, capacity()), which stores a small
+// saturating counter for each index, packed into 64 bit words. The counters
+// are updated by compare-and-swap loops on the words, so they need no locks.
+// An index is an element of the set while its counter is not zero.
+template<
+	size_t CounterBits = 4,
+	typename Concurrency = ConcurrencyPolicy::Concurrent
+>
+class CounterVectorSet
+{
+	static_assert(CounterBits == 2 || CounterBits == 4 || CounterBits == 8, "The counters have to be 2, 4 or 8 bits wide");
+
+	using Word = uint64_t;
+	static constexpr size_t c_countersPerWord = 64 / CounterBits;
+	static constexpr Word c_counterMask = (Word{ 1 } << CounterBits) - 1;
+
+	static_assert(sizeof(std::atomic<Word>) == sizeof(Word) && std::atomic<Word>::is_always_lock_free);
+
+public:
+	// The counters stop at this value instead of overflowing
+	static constexpr size_t c_maxCount = c_counterMask;
+
+	CounterVectorSet(size_t size, AllocationPolicy policy = {})
+		: m_storage(word_count(size) * sizeof(Word), policy),
+		m_data(static_cast<std::atomic<Word>*>(m_storage.data())),
+		m_size(size)
+	{
+	}
+
+	// Increments the counter of 'index', and returns its new value
+	size_t increment(size_t index)
+	{
+		return update(index, [](Word count)
+		{
+			return std::min(count + 1, c_counterMask);
+		});
+	}
+
+	// Decrements the counter of 'index' if it is not zero, and returns its new value
+	size_t decrement(size_t index)
+	{
+		return update(index, [](Word count)
+		{
+			return count ? count - 1 : 0;
+		});
+	}
+
+	size_t count(size_t index) const
+	{
+		if (index >= m_size)
+			return 0;
+
+		return (word(index).load(std::memory_order_relaxed) >> shift(index)) & c_counterMask;
+	}
+
+	// Sets the counter to 1 if it was 0
+	bool insert(size_t index)
+	{
+		bool inserted = false;
+		update(index, [&inserted](Word count)
+		{
+			inserted = count == 0;
+			return inserted ? Word{ 1 } : count;
+		});
+		return inserted;
+	}
+
+	// Sets the counter to 0
+	bool erase(size_t index)
+	{
+		bool erased = false;
+		update(index, [&erased](Word count)
+		{
+			erased = count != 0;
+			return Word{ 0 };
+		});
+		return erased;
+	}
+
+	bool contains(size_t index) const
+	{
+		return count(index) != 0;
+	}
+
+	// Number of indices with a non-zero counter
+	size_t size() const
+	{
+		return static_cast<size_t>(std::max<std::ptrdiff_t>(m_count.load(), 0));
+	}
+
+	size_t capacity() const
+	{
+		return m_size;
+	}
+
+	// Sets every counter to zero. Must not run concurrently with any other operation.
+	void clear()
+	{
+		m_storage.clear();
+		m_count.reset();
+	}
+
+	const AllocationPolicy& allocation_policy() const
+	{
+		return m_storage.policy();
+	}
+
+private:
+	// Replaces the counter of 'index' with f(counter) and returns the new
+	// value. f may be called more than once if other threads modify the word.
+	template<typename F>
+	size_t update(size_t index, F&& f)
+	{
+		if (index >= m_size)
+			return 0;
+
+		auto& atomicWord = word(index);
+		const size_t counterShift = shift(index);
+
+		Word oldWord = atomicWord.load(std::memory_order_relaxed);
+		Word oldCount, newCount;
+		Backoff backoff;
+		while (true)
+		{
+			oldCount = (oldWord >> counterShift) & c_counterMask;
+			newCount = f(oldCount);
+			if (newCount == oldCount)
+				return static_cast<size_t>(newCount);
+
+			Word newWord = (oldWord & ~(c_counterMask << counterShift)) | (newCount << counterShift);
+			if (Concurrency::compare_exchange_weak(atomicWord, oldWord, newWord, std::memory_order_release))
+				break;
+
+			// Other threads are updating the counters of the same word
+			backoff.pause();
+		}
+
+		if (oldCount == 0)
+			m_count.add(1);
+		else if (newCount == 0)
+			m_count.add(-1);
+
+		return static_cast<size_t>(newCount);
+	}
+
+	static constexpr size_t word_count(size_t counters)
+	{
+		return (counters + c_countersPerWord - 1) / c_countersPerWord;
+	}
+
+	static size_t shift(size_t index)
+	{
+		return index % c_countersPerWord * CounterBits;
+	}
+
+	std::atomic<Word>& word(size_t index)
+	{
+		return m_data[index / c_countersPerWord];
+	}
+
+	const std::atomic<Word>& word(size_t index) const
+	{
+		return m_data[index / c_countersPerWord];
+	}
+
+	PageAllocation m_storage;
+	std::atomic<Word>* m_data;
+	size_t m_size;
+	typename Concurrency::Counter m_count;
+};
@@ -1,8 +1,17 @@
 #pragma once
+#include <algorithm>
 #include <atomic>
 #include <bit>
-#include <unordered_set>
+#include <cmath>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+#include "ConcurrencyPolicy.h"
+#include "HashTraits.h"
 #include "List.h"
 
 inline uint32_t reverse(uint32_t x)
@@ -26,79 +35,411 @@ inline uint64_t reverse(uint64_t x)
 	return x;
 }
 
-template<typename T, std::size_t BlockSize = 128, class Hasher = std::hash<T>>
+// A concurrent hash set based on split-ordered lists. The elements of a bucket
+// are kept in a List, sorted by the reversed bits of their hashes, so that
+// the elements moving to a new bucket are always a suffix of the list of its
+// parent. The buckets are found through a directory of segments, each twice
+// as large as the previous one, so existing buckets never move. New buckets
+// are initialized lazily by the first operation using them, by splitting
+// their parent. No lock is shared by all the operations: each takes a
+// shared lock on its bucket, and only the split of a bucket locks it exclusively.
+// Hash is the width of the stored hashes, which also limits the number of
+// buckets; uint64_t lets the table grow past 2^32 buckets.
+// When most of the elements are erased, the last bucket is merged back into
+// its parent, one bucket at a time, under the locks of both. The merged
+// buckets are kept, marked as not live, since other threads may be waiting
+// for their locks, and they are reused when the table grows again.
+// The *_hashed operations and the lookups by other key types are described
+// in HashTraits.h; the keys are compared with the elements by <.
+template<
+	typename T,
+	std::size_t BlockSize = 128,
+	class Hasher = std::hash<T>,
+	typename Concurrency = ConcurrencyPolicy::Concurrent,
+	typename Hash = uint32_t
+>
 class HashSet
 {
-	using Mutex = std::shared_mutex;
+	using Mutex = typename Concurrency::Mutex;
 	using UniqueLock = std::unique_lock<Mutex>;
 	using SharedLock = std::shared_lock<Mutex>;
-	using Hash = uint32_t;
-	using Bucket = List<std::pair<Hash, T>, BlockSize>;
+	static_assert(std::is_same_v<Hash, uint32_t> || std::is_same_v<Hash, uint64_t>, "The hashes have to be 32 or 64 bits wide");
+
+	// A key of a lookup, which is compared to the stored pairs without copying it
+	template<typename K>
+	struct BucketKey
+	{
+		Hash first;
+		const K& second;
+	};
+
+	// Orders the pairs and the keys by the reversed hash, then by the element
+	struct BucketLess
+	{
+		using is_transparent = void;
+
+		template<typename L, typename R>
+		bool operator()(const L& lhs, const R& rhs) const
+		{
+			if (lhs.first != rhs.first)
+				return lhs.first < rhs.first;
+			return lhs.second < rhs.second;
+		}
+	};
+
+	using BucketList = List<std::pair<Hash, T>, BlockSize, BucketLess, Concurrency>;
+
+	struct Bucket
+	{
+		Mutex m_mutex;
+		BucketList m_list;
+		// False while the elements of the bucket are in its parent
+		std::atomic<bool> m_live = false;
+	};
+
+	// Segment 0 holds buckets 0 and 1, segment k > 0 holds [2^k, 2^(k+1)).
+	// Every bit of the hash can select a bucket, as long as the count fits in size_t.
+	static constexpr size_t c_segments = std::min(sizeof(Hash), sizeof(size_t)) * 8 - (sizeof(Hash) >= sizeof(size_t));
 
 public:
+	// The result of Hasher. Only its low sizeof(Hash) bytes are used.
+	using hash_type = std::size_t;
+
 	HashSet(size_t startBucketSize = 32, Hasher hasher = {})
 		: m_hasher(std::move(hasher))
 	{
 		assert(startBucketSize > 0);
-		for (size_t i = 0; i < startBucketSize; i++)
+		m_bucketCount = std::min(startBucketSize, c_maxBucketCount);
+		m_minBucketCount = m_bucketCount.load(std::memory_order_relaxed);
+		auto* first = new Bucket;
+		first->m_live.store(true, std::memory_order_relaxed);
+		slot(0).store(first, std::memory_order_release);
+	}
+
+	HashSet(const HashSet&) = delete;
+	HashSet& operator=(const HashSet&) = delete;
+
+	~HashSet()
+	{
+		for (size_t segment = 0; segment < c_segments; segment++)
 		{
-			m_buckets.emplace_back(std::make_unique<Bucket>());
+			auto* buckets = m_segments[segment].load(std::memory_order_acquire);
+			if (!buckets)
+				continue;
+
+			for (size_t i = 0; i < segment_size(segment); i++)
+				delete buckets[i].load(std::memory_order_relaxed);
+			delete[] buckets;
 		}
 	}
 
 	bool insert(T elem)
 	{
-		Hash hash = static_cast<Hash>(m_hasher(elem));
-		Hash reverseHash = reverse(hash);
-
-		SharedLock lock{ m_bucketsMutex };
-
-		auto bucketIdx = bucket(hash);
+		const hash_type hash = m_hasher(elem);
+		return insert_hashed(std::move(elem), hash);
+	}
 
-		bool ret = m_buckets[bucketIdx]->insert({ reverseHash, elem });
-		if (ret) m_size++;
+	bool insert_hashed(T elem, hash_type hashValue)
+	{
+		const Hash hash = static_cast<Hash>(hashValue);
 
-		if (private_load_factor() > max_load_factor())
+		bool ret = with_bucket(hash, [&](BucketList& list)
 		{
-			lock.unlock();
+			return list.insert({ reverse(hash), elem });
+		});
+		if (ret) m_size.add(1);
+
+		if (approximate_size() > max_load_factor() * bucket_count())
 			try_extend_buckets();
-		}
 
 		return ret; 
 	}
 
 	bool erase(const T& elem)
 	{
-		Hash hash = static_cast<Hash>(m_hasher(elem));
-		Hash reverseHash = reverse(hash);
+		return erase_key(elem, m_hasher(elem));
+	}
+
+	bool erase_hashed(const T& elem, hash_type hashValue)
+	{
+		return erase_key(elem, hashValue);
+	}
+
+	bool contains(const T& elem)
+	{
+		return contains_key(elem, m_hasher(elem));
+	}
+
+	bool contains_hashed(const T& elem, hash_type hashValue)
+	{
+		return contains_key(elem, hashValue);
+	}
+
+	template<typename K> requires TransparentHasher<Hasher>
+	bool erase(const K& key)
+	{
+		return erase_key(key, m_hasher(key));
+	}
+
+	template<typename K> requires TransparentHasher<Hasher>
+	bool erase_hashed(const K& key, hash_type hashValue)
+	{
+		return erase_key(key, hashValue);
+	}
 
-		SharedLock lock{ m_bucketsMutex };
+	template<typename K> requires TransparentHasher<Hasher>
+	bool contains(const K& key)
+	{
+		return contains_key(key, m_hasher(key));
+	}
 
-		auto bucketIdx = bucket(hash);
-		
-		bool ret = m_buckets[bucketIdx]->erase({ reverseHash, elem });
-		if (ret) m_size--;
+	template<typename K> requires TransparentHasher<Hasher>
+	bool contains_hashed(const K& key, hash_type hashValue)
+	{
+		return contains_key(key, hashValue);
+	}
+
+	// Calls f with the stored element equal to 'elem' while its node is locked,
+	// and erases the element if f returns false. f must not change the hash or
+	// the order of the element. Returns false if there is no such element.
+	template<typename F>
+	bool update(const T& elem, F&& f)
+	{
+		return update_hashed(elem, m_hasher(elem), std::forward<F>(f));
+	}
+
+	template<typename F>
+	bool update_hashed(const T& elem, hash_type hashValue, F&& f)
+	{
+		const Hash hash = static_cast<Hash>(hashValue);
+
+		bool erased = false;
+		bool ret = with_bucket(hash, [&](BucketList& list)
+		{
+			return list.update({ reverse(hash), elem }, [&f, &erased](std::pair<Hash, T>& p)
+			{
+				erased = !f(p.second);
+				return !erased;
+			});
+		});
+		if (erased)
+		{
+			m_size.add(-1);
+			try_shrink_buckets();
+		}
 
 		return ret;
 	}
 
-	bool contains(const T& elem)
+	// Calls f with every element. Can run concurrently with the other
+	// operations, and is weakly consistent: every element present during the
+	// whole traversal is visited exactly once, the elements inserted or erased
+	// meanwhile may or may not be. The buckets are walked in the split order,
+	// which growth does not change, and only the elements after the last
+	// visited one are reported, so splits during the walk cause no duplicates.
+	// f runs while a bucket is locked, so it must not modify the set.
+	template<typename F>
+	void for_each(F&& f)
+	{
+		std::optional<std::pair<Hash, T>> last;
+		Hash position = 0;
+		while (true)
+		{
+			// The same as with_bucket, but the count checked under the lock
+			// also gives the range of the bucket
+			const Hash hash = reverse(position);
+			size_t bucketIdx, bucketCount;
+			while (true)
+			{
+				bucketIdx = bucket(hash, m_bucketCount.load(std::memory_order_acquire));
+				Bucket* b = get_bucket(bucketIdx);
+				if (!b)
+					continue;
+
+				SharedLock lock{ b->m_mutex };
+				bucketCount = m_bucketCount.load(std::memory_order_acquire);
+				if (!b->m_live.load(std::memory_order_acquire) || bucket(hash, bucketCount) != bucketIdx)
+					continue;
+
+				b->m_list.for_each([&](const std::pair<Hash, T>& p)
+				{
+					if (!last || *last < p)
+					{
+						f(p.second);
+						last = p;
+					}
+				});
+				break;
+			}
+
+			// Continue at the first reversed hash after the range of the bucket
+			const size_t bits = bucket_bits(bucketIdx, bucketCount);
+			if (bits == 0)
+				return;
+
+			position = reverse(static_cast<Hash>(bucketIdx)) + (Hash{ 1 } << (sizeof(Hash) * 8 - bits));
+			if (position == 0)
+				return;
+		}
+	}
+
+	// The elements of the set at the time of snapshot(). The buckets share
+	// their nodes with the set, which copies them before it changes them.
+	class Snapshot
+	{
+	public:
+		template<typename F>
+		void for_each(F&& f) const
+		{
+			for (const auto& list : m_lists)
+			{
+				list.for_each([&f](const std::pair<Hash, T>& p)
+				{
+					f(p.second);
+				});
+			}
+		}
+
+		size_t size() const
+		{
+			size_t count = 0;
+			for_each([&count](const T&)
+			{
+				count++;
+			});
+			return count;
+		}
+
+	private:
+		friend class HashSet;
+
+		std::vector<typename BucketList::Snapshot> m_lists;
+	};
+
+	// Takes a consistent snapshot in time linear in the number of buckets.
+	// Every bucket is locked exclusively while the snapshot is taken, so the
+	// operations wait for it, but the copying of the elements is deferred
+	// to the writers changing them later.
+	Snapshot snapshot()
+	{
+		std::vector<Bucket*> buckets;
+		std::vector<UniqueLock> locks;
+
+		// The parent of a bucket is locked before it, so no bucket can be split
+		// from the locked ones; the count is read again after locking, as it
+		// may have grown meanwhile.
+		for (size_t bucketCount = m_bucketCount.load(std::memory_order_acquire); buckets.size() < bucketCount; bucketCount = m_bucketCount.load(std::memory_order_acquire))
+		{
+			for (size_t bucketIdx = buckets.size(); bucketIdx < bucketCount; bucketIdx++)
+			{
+				auto* b = bucket_at(bucketIdx);
+				if (b)
+					locks.emplace_back(b->m_mutex);
+				buckets.push_back(b);
+			}
+		}
+
+		Snapshot snapshot;
+		for (auto* b : buckets)
+		{
+			if (b && b->m_live.load(std::memory_order_relaxed))
+				snapshot.m_lists.push_back(b->m_list.snapshot());
+		}
+		return snapshot;
+	}
+
+	// Exact when no modifications run concurrently
+	size_t size() const
+	{
+		// The shards can be transiently negative while an erase races with the insert of the same element
+		return static_cast<size_t>(std::max<std::ptrdiff_t>(m_size.load(), 0));
+	}
+
+	// Erases every element, but keeps the buckets, so that the set does
+	// not have to grow again when it is refilled to a similar size.
+	// Must not run concurrently with other operations.
+	void clear()
+	{
+		const size_t bucketCount = m_bucketCount.load(std::memory_order_acquire);
+		for (size_t bucketIdx = 0; bucketIdx < bucketCount; bucketIdx++)
+		{
+			auto* bucket = bucket_at(bucketIdx);
+			if (bucket && bucket->m_live.load(std::memory_order_relaxed))
+				bucket->m_list.clear();
+		}
+
+		m_size.reset();
+	}
+
+	// Grows the table to at least 'bucketCount' buckets, rounded up to a power
+	// of two, and splits all of them in advance, so that the inserts do not
+	// have to. Large tables are split by several threads. The erases do not
+	// shrink the table below this size until shrink_to_fit().
+	// Can run concurrently with other operations.
+	void rehash(size_t bucketCount)
 	{
-		Hash hash = static_cast<Hash>(m_hasher(elem));
-		Hash reverseHash = reverse(hash);
+		bucketCount = std::min(std::bit_ceil(std::max<size_t>(bucketCount, 1)), c_maxBucketCount);
 
-		SharedLock lock{ m_bucketsMutex };
+		size_t minCount = m_minBucketCount.load(std::memory_order_relaxed);
+		while (minCount < bucketCount && !Concurrency::compare_exchange_weak(m_minBucketCount, minCount, bucketCount, std::memory_order_relaxed))
+		{
+		}
 
-		auto bucketIdx = bucket(hash);
+		size_t oldCount = m_bucketCount.load(std::memory_order_relaxed);
+		while (oldCount < bucketCount && !Concurrency::compare_exchange_weak(m_bucketCount, oldCount, bucketCount, std::memory_order_acq_rel))
+		{
+		}
 
-		return m_buckets[bucketIdx]->contains({ reverseHash, elem });
+		// Each bucket only depends on buckets with fewer bits, so the
+		// buckets with the same number of bits can be split in parallel
+		for (size_t levelBegin = 1; levelBegin < bucketCount; levelBegin *= 2)
+			initialize_buckets(levelBegin, std::min(2 * levelBegin, bucketCount));
 	}
 
-	float load_factor() const
+	// Prepares the table for 'count' elements without exceeding the max load factor
+	void reserve(size_t count)
+	{
+		rehash(static_cast<size_t>(std::ceil(count / max_load_factor())));
+	}
+
+	// Merges the buckets until the load factor reaches the max load factor,
+	// and moves the elements of every bucket into as few nodes as possible.
+	// Can run concurrently with other operations, which wait for the bucket
+	// being merged or compacted.
+	void shrink_to_fit()
 	{
-		SharedLock lock{ m_bucketsMutex };
+		const size_t fitCount = static_cast<size_t>(std::ceil(size() / max_load_factor()));
+		const size_t target = std::min(std::bit_ceil(std::max<size_t>(fitCount, 1)), c_maxBucketCount);
+		m_minBucketCount.store(target, std::memory_order_relaxed);
+
+		for (size_t bucketCount = bucket_count(); bucketCount > target; bucketCount = bucket_count())
+			shrink_bucket(bucketCount);
+
+		for (size_t bucketIdx = 0; bucketIdx < bucket_count(); bucketIdx++)
+		{
+			auto* b = bucket_at(bucketIdx);
+			if (!b)
+				continue;
 
-		return private_load_factor();
+			UniqueLock lock{ b->m_mutex };
+			if (b->m_live.load(std::memory_order_relaxed))
+				b->m_list.compact();
+		}
+	}
+
+	Hasher hash_function() const
+	{
+		return m_hasher;
+	}
+
+	size_t bucket_count() const
+	{
+		return m_bucketCount.load(std::memory_order_acquire);
+	}
+
+	float load_factor() const
+	{
+		return size() / static_cast<float>(bucket_count());
 	}
 
 	float max_load_factor() const
@@ -112,8 +453,44 @@ public:
 	}
 
 private:
-	// Assumption: a shared lock for m_bucketsMutex is acquired.
-	size_t bucket(Hash hash) const
+	static constexpr size_t c_maxBucketCount = size_t{ 1 } << c_segments;
+
+	template<typename K>
+	bool erase_key(const K& key, hash_type hashValue)
+	{
+		const Hash hash = static_cast<Hash>(hashValue);
+
+		bool ret = with_bucket(hash, [&](BucketList& list)
+		{
+			return list.erase(BucketKey<K>{ reverse(hash), key });
+		});
+		if (ret)
+		{
+			m_size.add(-1);
+			try_shrink_buckets();
+		}
+
+		return ret;
+	}
+
+	template<typename K>
+	bool contains_key(const K& key, hash_type hashValue)
+	{
+		const Hash hash = static_cast<Hash>(hashValue);
+
+		return with_bucket(hash, [&](BucketList& list)
+		{
+			return list.contains(BucketKey<K>{ reverse(hash), key });
+		});
+	}
+
+	size_t approximate_size() const
+	{
+		return static_cast<size_t>(std::max<std::ptrdiff_t>(m_size.approximate(), 0));
+	}
+
+	// The bucket of an element when there are 'bucketCount' buckets
+	static size_t bucket(Hash hash, size_t bucketCount)
 	{
 		// Examples:
 		// Size -> Mask
@@ -127,44 +504,263 @@ private:
 		// 7 -> bit_ceil(00000111)-1 = 00000111
 		// 8 -> bit_ceil(00001000)-1 = 00000111
 		// 9 -> bit_ceil(00001001)-1 = 00001111
-		auto mask = std::bit_ceil(m_buckets.size()) - 1;
+		auto mask = std::bit_ceil(bucketCount) - 1;
 		auto bucketIdx = hash & mask;
 
-		if (bucketIdx >= m_buckets.size())
+		if (bucketIdx >= bucketCount)
 			bucketIdx = hash & (mask >> 1);
 
-		assert(bucketIdx < m_buckets.size());
+		assert(bucketIdx < bucketCount);
 
 		return bucketIdx;
 	}
 
-	// Assumption: a shared lock for m_bucketsMutex is acquired.
-	float private_load_factor() const
+	// Runs f on the list of the bucket of 'hash', while the bucket is locked
+	// for sharing. The bucket count can grow after it is read, and a child of
+	// the bucket can take over the element. That happens under the exclusive
+	// lock of the bucket, so the count is checked again while it is locked.
+	// The bucket can also be merged into its parent while this thread waits
+	// for its lock, and the count may grow back before the bucket is split again.
+	template<typename F>
+	auto with_bucket(Hash hash, F&& f)
+	{
+		while (true)
+		{
+			size_t bucketIdx = bucket(hash, m_bucketCount.load(std::memory_order_acquire));
+			Bucket* b = get_bucket(bucketIdx);
+			if (!b)
+				continue;
+
+			SharedLock lock{ b->m_mutex };
+			if (b->m_live.load(std::memory_order_acquire) && bucket(hash, m_bucketCount.load(std::memory_order_acquire)) == bucketIdx)
+				return f(b->m_list);
+		}
+	}
+
+	// The number of the low bits of the hashes which select the bucket
+	// when there are 'bucketCount' buckets
+	static size_t bucket_bits(size_t bucketIdx, size_t bucketCount)
+	{
+		const size_t bits = std::bit_width(bucketCount - 1);
+		if (bits == 0)
+			return 0;
+
+		// The buckets without a child yet take the hashes of the missing child
+		const size_t half = size_t{ 1 } << (bits - 1);
+		return bucketIdx >= half || bucketIdx + half < bucketCount ? bits : bits - 1;
+	}
+
+	// The live bucket, or nullptr if the count has shrunk below the index
+	Bucket* get_bucket(size_t bucketIdx)
 	{
-		return m_size / static_cast<float>(m_buckets.size());
+		auto* bucket = bucket_at(bucketIdx);
+		if (bucket && bucket->m_live.load(std::memory_order_acquire))
+			return bucket;
+
+		return initialize_bucket(bucketIdx);
 	}
 
+	// Splits the new bucket from its parent, which is the bucket without
+	// the highest set bit of the index. The suffix of the parent starting at
+	// the reversed index only belongs to this bucket if the siblings with
+	// smaller indices have already taken their elements, so they are
+	// initialized first. The bucket and its siblings are only split or
+	// merged under the lock of the parent.
+	Bucket* initialize_bucket(size_t bucketIdx)
+	{
+		assert(bucketIdx > 0);
+		const size_t highestBit = std::bit_floor(bucketIdx);
+		const size_t parentIdx = bucketIdx - highestBit;
+
+		while (true)
+		{
+			Bucket* parent = get_bucket(parentIdx);
+			if (!parent)
+				return nullptr;
+
+			for (size_t siblingBit = std::bit_ceil(parentIdx + 1); siblingBit < highestBit; siblingBit <<= 1)
+			{
+				if (!get_bucket(parentIdx + siblingBit))
+					return nullptr;
+			}
+
+			UniqueLock lock{ parent->m_mutex };
+
+			if (bucketIdx >= m_bucketCount.load(std::memory_order_acquire))
+				return nullptr;
+
+			// Another thread might have split it while this one was waiting for the lock
+			auto& bucketSlot = slot(bucketIdx);
+			auto* bucket = bucketSlot.load(std::memory_order_acquire);
+			if (bucket && bucket->m_live.load(std::memory_order_relaxed))
+				return bucket;
+
+			// The parent or a sibling may have been merged since, and not split again
+			if (!parent->m_live.load(std::memory_order_relaxed) || !siblings_live(parentIdx, highestBit))
+				continue;
+
+			if (!bucket)
+			{
+				bucket = new Bucket;
+				bucketSlot.store(bucket, std::memory_order_release);
+			}
+
+			Hash splitHash = reverse(static_cast<Hash>(bucketIdx));
+			parent->m_list.split_after(bucket->m_list, [splitHash](const std::pair<Hash, T>& p)
+			{
+				return p.first < splitHash;
+			});
+
+			bucket->m_live.store(true, std::memory_order_release);
+			return bucket;
+		}
+	}
+
+	bool siblings_live(size_t parentIdx, size_t highestBit)
+	{
+		for (size_t siblingBit = std::bit_ceil(parentIdx + 1); siblingBit < highestBit; siblingBit <<= 1)
+		{
+			auto* sibling = bucket_at(parentIdx + siblingBit);
+			if (!sibling || !sibling->m_live.load(std::memory_order_relaxed))
+				return false;
+		}
+		return true;
+	}
+
+	// Initializes the buckets in [begin, end), split between the hardware threads when there are many
+	void initialize_buckets(size_t begin, size_t end)
+	{
+		constexpr size_t minBucketsPerThread = 4096;
+		size_t threadCount = std::clamp<size_t>((end - begin) / minBucketsPerThread, 1, std::max(1u, std::thread::hardware_concurrency()));
+		size_t bucketsPerThread = (end - begin + threadCount - 1) / threadCount;
+
+		auto initialize = [this, begin, end, bucketsPerThread](size_t i)
+		{
+			for (size_t bucketIdx = begin + i * bucketsPerThread; bucketIdx < std::min(end, begin + (i + 1) * bucketsPerThread); bucketIdx++)
+				get_bucket(bucketIdx);
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < threadCount; i++)
+			threads.emplace_back(initialize, i);
+
+		initialize(0);
+
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	static size_t segment_of(size_t bucketIdx)
+	{
+		return bucketIdx < 2 ? 0 : std::bit_width(bucketIdx) - 1;
+	}
+
+	static size_t segment_size(size_t segment)
+	{
+		return segment == 0 ? 2 : size_t{ 1 } << segment;
+	}
+
+	static size_t segment_offset(size_t segment, size_t bucketIdx)
+	{
+		return segment == 0 ? bucketIdx : bucketIdx - segment_size(segment);
+	}
+
+	// The bucket in the directory, or nullptr if it was never created.
+	// Unlike slot(), it does not allocate the segment.
+	Bucket* bucket_at(size_t bucketIdx) const
+	{
+		const size_t segment = segment_of(bucketIdx);
+		auto* buckets = m_segments[segment].load(std::memory_order_acquire);
+		if (!buckets)
+			return nullptr;
+
+		return buckets[segment_offset(segment, bucketIdx)].load(std::memory_order_acquire);
+	}
+
+	// The slot of the bucket in the directory. The segments are allocated
+	// when they are first used; if threads race for it, one of them wins.
+	std::atomic<Bucket*>& slot(size_t bucketIdx)
+	{
+		const size_t segment = segment_of(bucketIdx);
+		const size_t offset = segment_offset(segment, bucketIdx);
+
+		auto* buckets = m_segments[segment].load(std::memory_order_acquire);
+		if (!buckets)
+		{
+			auto* newBuckets = new std::atomic<Bucket*>[segment_size(segment)]();
+			if (Concurrency::compare_exchange_strong(m_segments[segment], buckets, newBuckets, std::memory_order_acq_rel))
+				buckets = newBuckets;
+			else
+				delete[] newBuckets;
+		}
+
+		return buckets[offset];
+	}
+
+	// Doubles the number of buckets. Nothing is moved here: each new bucket is
+	// split from its parent by the first operation using it, so the work of the
+	// growth is spread over the threads touching the buckets.
 	void try_extend_buckets()
 	{
-		UniqueLock lock{ m_bucketsMutex };
-		
-		if (private_load_factor() <= max_load_factor())
+		size_t bucketCount = m_bucketCount.load(std::memory_order_relaxed);
+		if (bucketCount < c_maxBucketCount && approximate_size() > max_load_factor() * bucketCount)
+			Concurrency::compare_exchange_strong(m_bucketCount, bucketCount, std::min(2 * bucketCount, c_maxBucketCount), std::memory_order_acq_rel);
+	}
+
+	// Shrinks the table once the load factor falls below a quarter of the max
+	// load factor, so that a table at the max load factor can lose three
+	// quarters of its elements before it shrinks, and then it has to double
+	// its elements before it grows again. Each erase merges one bucket.
+	void try_shrink_buckets()
+	{
+		size_t bucketCount = m_bucketCount.load(std::memory_order_relaxed);
+		if (bucketCount <= m_minBucketCount.load(std::memory_order_relaxed))
+			return;
+
+		// The approximate size only filters out the erases far from the
+		// threshold; it can be too low by up to c_maxError, which would merge
+		// buckets of tables above it
+		const float threshold = max_load_factor() * bucketCount;
+		if ((m_size.approximate() - Concurrency::Counter::c_maxError) * 4 < threshold && size() * 4 < threshold)
+			shrink_bucket(bucketCount);
+	}
+
+	// Merges the last bucket into its parent, if there are still 'bucketCount'
+	// buckets. Its children have higher indices, so they are merged already.
+	void shrink_bucket(size_t bucketCount)
+	{
+		assert(bucketCount > 1);
+		const size_t bucketIdx = bucketCount - 1;
+		const size_t parentIdx = bucketIdx - std::bit_floor(bucketIdx);
+
+		Bucket* parent = get_bucket(parentIdx);
+		if (!parent)
 			return;
 
-		size_t newBucketIdx = m_buckets.size();
-		size_t lowerBucket = newBucketIdx - std::bit_floor(newBucketIdx);
-		auto& newBucket = m_buckets.emplace_back(std::make_unique<Bucket>());
+		// The parent is locked first, like in snapshot()
+		UniqueLock parentLock{ parent->m_mutex }, lock;
+		Bucket* b = bucket_at(bucketIdx);
+		if (b)
+			lock = UniqueLock{ b->m_mutex };
+
+		if (!Concurrency::compare_exchange_strong(m_bucketCount, bucketCount, bucketIdx, std::memory_order_acq_rel))
+			return;
 
-		Hash hash = reverse(static_cast<Hash>(newBucketIdx));
-		m_buckets[lowerBucket]->split_after(*newBucket, [&hash](const std::pair<Hash, T>& p)
+		// A live bucket has a live parent, since the parent can only be merged after it
+		if (b && b->m_live.load(std::memory_order_relaxed))
 		{
-			return p.first < hash;
-		});
+			parent->m_list.append(b->m_list);
+			b->m_live.store(false, std::memory_order_release);
+		}
 	}
 
-	std::atomic<std::size_t> m_size;
-	std::vector<std::unique_ptr<Bucket>> m_buckets;
-	mutable Mutex m_bucketsMutex;
+	// The number of elements is sharded, so that the inserts and erases do not
+	// all write the same cache line. Growth uses the cheap approximate value.
+	typename Concurrency::Counter m_size;
+	std::atomic<std::size_t> m_bucketCount;
+	// The erases do not shrink the table below this
+	std::atomic<std::size_t> m_minBucketCount;
+	std::atomic<std::atomic<Bucket*>*> m_segments[c_segments] = {};
 	Hasher m_hasher;
 
 	std::atomic<float> m_maxLoadFactor = 768.;
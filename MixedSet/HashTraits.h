@@ -0,0 +1,17 @@
+#pragma once
+
+// The hash sets and MixedSet share two extensions of their operations:
+//
+// The *_hashed variants take hash_function()(elem) computed by the caller,
+// who may need the hash for other purposes too, so the set does not hash
+// the element again.
+//
+// With a TransparentHasher, contains and erase also take keys of other types
+// than the elements, like std::string_view for std::string elements, so the
+// lookups do not have to construct an element. The key has to hash like the
+// equal elements, and to compare with them like the elements do.
+template<typename Hasher>
+concept TransparentHasher = requires
+{
+	typename Hasher::is_transparent;
+};
@@ -1,25 +1,36 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <memory>
 #include <shared_mutex>
 #include <array>
 #include <algorithm>
-
+#include <mutex>
+#include "ConcurrencyPolicy.h"
+
+// A sorted list of blocks, with a lock per block. The blocks can be shared
+// with snapshots: every block remembers the epoch of the list when it was
+// created, and taking a snapshot starts a new epoch. Writers replace the
+// blocks of earlier epochs with copies before they change them, so the
+// blocks seen by a snapshot never change.
 template<
 	typename T,
 	std::size_t Size = 128,
-	typename Less = std::less<T>
+	typename Less = std::less<T>,
+	typename Concurrency = ConcurrencyPolicy::Concurrent
 >
 class List
 {
-	using Mutex = std::shared_mutex;
+	using Mutex = typename Concurrency::Mutex;
 	using UniqueLock = std::unique_lock<Mutex>;
 	using SharedLock = std::shared_lock<Mutex>;
 
+	struct Node;
+
 public:
 	List()
-		:m_head{ std::make_shared<Node>() }
+		:m_head{ std::make_shared<Node>(m_epoch) }
 	{
 
 	}
@@ -27,14 +38,14 @@ public:
 	bool insert(const T& value)
 	{
 		UniqueLock currentLock{ m_headMutex };
-		auto currentNode = m_head;
+		auto currentNode = own(m_head);
 		UniqueLock nextLock{ currentNode->m_mutex };
 		decltype(currentNode) tail;
 		while (currentNode)
 		{
 			tail = currentNode;
 			currentLock = std::move(nextLock);
-			auto nextNode = currentNode->m_next;
+			auto nextNode = own(currentNode->m_next);
 			if (nextNode) nextLock = UniqueLock{ nextNode->m_mutex };
 
 			auto valueIter = currentNode->find(value);
@@ -65,15 +76,31 @@ public:
 			currentNode = nextNode;
 		}
 
-		tail->m_next = std::make_shared<Node>(value);
+		tail->m_next = std::make_shared<Node>(value, m_epoch);
 
 		return true;
 	}
 
-	bool erase(const T& value)
+	// The lookups can use a key of another type if Less is transparent.
+	// An element matches the key if neither is less than the other.
+	template<typename K = T>
+	bool erase(const K& value)
+	{
+		return update(value, [](T&)
+		{
+			return false;
+		});
+	}
+
+	// Calls f with the element equal to 'value' while its node is locked.
+	// f can modify the parts of the element which do not affect the order,
+	// and the element is erased if f returns false.
+	// Returns false if there is no such element.
+	template<typename K = T, typename F>
+	bool update(const K& value, F&& f)
 	{
 		UniqueLock prevLock, currentLock{ m_headMutex };
-		auto currentNode = m_head;
+		auto currentNode = own(m_head);
 		decltype(currentNode) prevNode;
 		while (currentNode)
 		{
@@ -84,9 +111,12 @@ public:
 			auto valueIter = currentNode->find(value);
 			if (valueIter != currentNode->end())
 			{
-				if (*valueIter != value)
+				if (Less()(value, *valueIter))
 					return false;
 
+				if (f(*valueIter))
+					return true;
+
 				currentNode->erase(valueIter);
 				if (currentNode->m_size == 0)
 				{
@@ -99,6 +129,21 @@ public:
 						m_head = m_head->m_next; // remove the first list element
 					}
 				}
+				else if (auto& nextNode = own(currentNode->m_next))
+				{
+					// Underfull neighbours are merged. Nodes split when they are full,
+					// so the halves do not merge again right away. The size of the next
+					// node is read under its lock, as an insert may be changing it.
+					UniqueLock nextLock{ nextNode->m_mutex };
+					if (currentNode->m_size + nextNode->m_size <= Size / 2)
+					{
+						std::copy(nextNode->begin(), nextNode->end(), currentNode->end());
+						currentNode->m_size += nextNode->m_size;
+						auto following = nextNode->m_next;
+						nextLock.unlock();
+						currentNode->m_next = std::move(following);
+					}
+				}
 				currentLock.unlock();
 				return true;
 			}
@@ -107,7 +152,7 @@ public:
 				if (auto nextNode = currentNode->m_next)
 				{
 					auto nextLock = SharedLock{ nextNode->m_mutex };
-					if (nextNode->m_contents.front() > value)
+					if (Less()(value, nextNode->m_contents.front()))
 					{
 						return false;
 					}
@@ -115,14 +160,15 @@ public:
 			}
 
 			prevNode = currentNode;
-			currentNode = currentNode->m_next;
+			currentNode = own(currentNode->m_next);
 		}
 
 		return false;
 	}
 
 
-	bool contains(const T& value) const
+	template<typename K = T>
+	bool contains(const K& value) const
 	{
 		SharedLock currentLock{ m_headMutex }, nextLock;
 		auto currentNode = m_head;
@@ -135,7 +181,7 @@ public:
 				nextLock = SharedLock{ nextNode->m_mutex };
 
 			auto valueIter = currentNode->find(value);
-			if (valueIter != currentNode->end() && *valueIter == value)
+			if (valueIter != currentNode->end() && !Less()(value, *valueIter))
 				return true;
 
 			currentNode = nextNode;
@@ -143,9 +189,125 @@ public:
 		return false;
 	}
 
+	// Calls f with every element while its node is locked for sharing.
+	// The elements inserted or erased concurrently may or may not be visited.
+	template<typename F>
+	void for_each(F&& f) const
+	{
+		SharedLock currentLock{ m_headMutex }, nextLock;
+		auto currentNode = m_head;
+		if (currentNode) nextLock = SharedLock{ currentNode->m_mutex };
+		while (currentNode)
+		{
+			currentLock = std::move(nextLock);
+			auto nextNode = currentNode->m_next;
+			if (nextNode)
+				nextLock = SharedLock{ nextNode->m_mutex };
+
+			for (const auto& elem : *currentNode)
+				f(elem);
+
+			currentNode = nextNode;
+		}
+	}
+
+	// The elements of the list at the time the snapshot was taken
+	class Snapshot
+	{
+	public:
+		template<typename F>
+		void for_each(F&& f) const
+		{
+			for (const Node* node = m_head.get(); node; node = node->m_next.get())
+			{
+				for (const auto& elem : *node)
+					f(elem);
+			}
+		}
+
+	private:
+		friend class List;
+
+		explicit Snapshot(std::shared_ptr<const Node> head)
+			: m_head(std::move(head))
+		{
+		}
+
+		std::shared_ptr<const Node> m_head;
+	};
+
+	// Shares the nodes with the snapshot until they are modified.
+	// Must not run concurrently with modifications of the list.
+	Snapshot snapshot()
+	{
+		UniqueLock lock{ m_headMutex };
+		m_epoch++;
+		return Snapshot{ m_head };
+	}
+
+	// Must not run concurrently with other operations.
+	void clear()
+	{
+		UniqueLock lock{ m_headMutex };
+		m_head = std::make_shared<Node>(m_epoch);
+	}
+
+	// Moves the elements of 'other' to the end of this list. They must all be
+	// greater than the elements of this list.
+	// Must not run concurrently with other operations on the lists.
+	void append(List& other)
+	{
+		// The nodes of earlier epochs of either list stay shared
+		m_epoch = std::max(m_epoch, other.m_epoch);
+
+		// Only the head of an empty list can be an empty node
+		auto otherHead = std::move(other.m_head);
+		if (otherHead->m_size == 0)
+			return;
+
+		auto* link = &own(m_head);
+		while ((*link)->m_next)
+			link = &own((*link)->m_next);
+
+		if ((*link)->m_size == 0)
+			*link = std::move(otherHead);
+		else
+			(*link)->m_next = std::move(otherHead);
+	}
+
+	// Moves the elements to the front, so that only the last node is not full.
+	// Must not run concurrently with other operations.
+	void compact()
+	{
+		UniqueLock lock{ m_headMutex };
+		for (Node* node = own(m_head).get(); node; node = node->m_next.get())
+		{
+			while (node->m_size < Size && node->m_next)
+			{
+				Node& next = *own(node->m_next);
+				std::size_t moved = std::min(Size - node->m_size, next.m_size);
+				std::copy(next.begin(), next.begin() + moved, node->end());
+				std::copy(next.begin() + moved, next.end(), next.begin());
+				node->m_size += moved;
+				next.m_size -= moved;
+
+				if (next.m_size == 0)
+				{
+					auto following = next.m_next;
+					node->m_next = std::move(following);
+				}
+			}
+		}
+	}
+
 	template<typename F>
 	void split_after(List& upperPart, F&& f)
 	{
+		// The nodes are moved to the other list, so none of them can be shared
+		upperPart.m_epoch = std::max(upperPart.m_epoch, m_epoch);
+		for (auto* link = &m_head; *link; link = &(*link)->m_next)
+			own(*link);
+
 		auto currentNode = m_head;
 		decltype(currentNode) prev;
 		while (currentNode)
@@ -161,11 +323,12 @@ public:
 				if (prev)
 					prev->m_next = nullptr;
 				else
-					m_head = std::make_shared<Node>();
+					m_head = std::make_shared<Node>(m_epoch);
+				return;
 			}
 			else if (iter != currentNode->end())
 			{
-				auto newNode = std::make_shared<Node>();
+				auto newNode = std::make_shared<Node>(m_epoch);
 				std::copy(iter, currentEnd, newNode->begin());
 				newNode->m_size = currentEnd - iter;
 				newNode->m_next = nextNode;
@@ -181,7 +344,7 @@ public:
 
 		// If the partition point wasn't found until this point,
 		// return an empty list as the second partition
-		upperPart.m_head = std::make_shared<Node>();
+		upperPart.m_head = std::make_shared<Node>(m_epoch);
 	}
 
 private:
@@ -192,14 +355,26 @@ private:
 		std::array<T, Size> m_contents;
 		std::shared_ptr<Node> m_next;
 		Mutex m_mutex;
+		// The epoch of the list when the node was created
+		uint64_t m_epoch;
+
+		explicit Node(uint64_t epoch)
+			:m_epoch{ epoch }
+		{
+		}
 
-		Node() = default;
-		Node(const T& initialValue)
-			:m_size{ 1 }
+		Node(const T& initialValue, uint64_t epoch)
+			:m_size{ 1 }, m_epoch{ epoch }
 		{
 			m_contents[0] = initialValue;
 		}
 
+		// A copy of a node shared with snapshots
+		Node(const Node& other, uint64_t epoch)
+			:m_size{ other.m_size }, m_contents{ other.m_contents }, m_next{ other.m_next }, m_epoch{ epoch }
+		{
+		}
+
 		auto begin()
 		{
 			return std::begin(m_contents);
@@ -210,12 +385,23 @@ private:
 			return begin() + m_size;
 		}
 
+		auto begin() const
+		{
+			return std::begin(m_contents);
+		}
+
+		auto end() const
+		{
+			return begin() + m_size;
+		}
+
 		auto size() -> std::size_t
 		{
 			return end() - begin();
 		}
 
-		auto find(const T& value)
+		template<typename K>
+		auto find(const K& value)
 		{
 			return std::lower_bound(begin(), end(), value, Less());
 		}
@@ -240,7 +426,7 @@ private:
 
 		void insert_and_split(const T& value, typename decltype(m_contents)::iterator iter)
 		{
-			auto newNode = std::make_shared<Node>();
+			auto newNode = std::make_shared<Node>(m_epoch);
 			newNode->m_next = m_next;
 			std::size_t pos = iter - m_contents.begin();
 			std::size_t midPos = m_size / 2;
@@ -284,6 +470,18 @@ private:
 		}
 	};
 
+	// Replaces the node at 'link' with a copy if it is shared with a snapshot.
+	// The owner of the link must be locked.
+	std::shared_ptr<Node>& own(std::shared_ptr<Node>& link)
+	{
+		if (link && link->m_epoch < m_epoch)
+			link = std::make_shared<Node>(*link, m_epoch);
+		return link;
+	}
+
 	mutable Mutex m_headMutex;
+	// Incremented by every snapshot. Only read by the writers, which cannot
+	// run concurrently with snapshot().
+	uint64_t m_epoch = 0;
 	std::shared_ptr<Node> m_head;
 };
\ No newline at end of file
@@ -1,44 +1,339 @@
 #pragma once
+#include <algorithm>
+#include <concepts>
+#include <type_traits>
 #include "BitVectorSet.h"
+#include "CounterVectorSet.h"
 #include "HashSet.h"
+#include "HashTraits.h"
+#include "RoaringSet.h"
+#include "SwissHashSet.h"
 
-template<typename T, typename Linearizer, std::size_t BlockSize = 128, class Hasher = std::hash<T>>
+// Dense sets which store a counter for each element, like CounterVectorSet
+template<typename DenseSet>
+concept CountingSet = requires(DenseSet set, size_t index)
+{
+	set.increment(index);
+	set.decrement(index);
+	set.count(index);
+};
+
+// An element of the hash side of counting MixedSets.
+// Only the value takes part in the comparisons and the hashing.
+template<typename T>
+struct Counted
+{
+	T value{};
+	size_t count = 1;
+
+	friend bool operator==(const Counted& lhs, const Counted& rhs)
+	{
+		return lhs.value == rhs.value;
+	}
+
+	friend bool operator<(const Counted& lhs, const Counted& rhs)
+	{
+		return lhs.value < rhs.value;
+	}
+
+	// Heterogeneous lookups compare the keys with the value
+	template<typename K>
+	friend bool operator==(const Counted& lhs, const K& rhs)
+	{
+		return lhs.value == rhs;
+	}
+
+	template<typename K>
+	friend bool operator<(const Counted& lhs, const K& rhs)
+	{
+		return lhs.value < rhs;
+	}
+
+	template<typename K>
+	friend bool operator<(const K& lhs, const Counted& rhs)
+	{
+		return lhs < rhs.value;
+	}
+};
+
+// Gives is_transparent to CountedHasher if the Hasher has it
+template<class Hasher>
+struct TransparentAs
+{
+};
+
+template<TransparentHasher Hasher>
+struct TransparentAs<Hasher>
+{
+	using is_transparent = typename Hasher::is_transparent;
+};
+
+template<typename T, class Hasher>
+struct CountedHasher : TransparentAs<Hasher>
+{
+	Hasher hasher;
+
+	size_t operator()(const Counted<T>& counted) const
+	{
+		return hasher(counted.value);
+	}
+
+	template<typename K> requires TransparentHasher<Hasher>
+	size_t operator()(const K& key) const
+	{
+		return hasher(key);
+	}
+};
+
+// Backends of the hash set which stores the elements outside the linearized region
+template<typename Hash = uint32_t>
+struct SplitOrderedBackend
+{
+	template<typename T, std::size_t BlockSize, class Hasher, typename Concurrency>
+	using Set = HashSet<T, BlockSize, Hasher, Concurrency, Hash>;
+};
+
+// Open addressing, which does not use BlockSize
+struct SwissBackend
+{
+	template<typename T, std::size_t BlockSize, class Hasher, typename Concurrency>
+	using Set = SwissHashSet<T, Hasher, Concurrency>;
+};
+
+// Concurrency is one of the ConcurrencyPolicy types, and it is used by all parts of the set.
+// DenseSet stores the elements in the linearized region, and can be
+// BitVectorSet, or RoaringSet for large, sparsely occupied regions.
+// If it is a CounterVectorSet, the set is a multiset, which counts
+// how many times each element was added up to DenseSet::c_maxCount.
+// SparseBackend chooses the hash set of the other elements: SplitOrderedBackend
+// or SwissBackend. The meaning of max_load_factor depends on it.
+// The *_hashed operations and the lookups by other key types are described
+// in HashTraits.h. The hashes are only used outside the linearized region,
+// and the Linearizer has to take the keys too.
+template<
+	typename T,
+	typename Linearizer,
+	std::size_t BlockSize = 128,
+	class Hasher = std::hash<T>,
+	typename Concurrency = ConcurrencyPolicy::Concurrent,
+	class DenseSet = BitVectorSet<ReleaseOrdering, Concurrency>,
+	class SparseBackend = SplitOrderedBackend<>
+>
 class MixedSet
 {
+	// The keys which the lookups take besides T
+	template<typename K>
+	static constexpr bool c_transparentKey = TransparentHasher<Hasher> && std::invocable<Linearizer&, const K&>;
+
 public:
-	MixedSet(Linearizer linearizer = {})
-		: m_linearizer(std::move(linearizer)), m_bitvector(Linearizer::size)
+	// The result of Hasher, which both hash set backends take
+	using hash_type = std::size_t;
+
+	MixedSet(Linearizer linearizer = {}, AllocationPolicy policy = {})
+		: m_linearizer(std::move(linearizer)), m_bitvector(Linearizer::size, policy)
 	{
 	}
 
 	bool insert(T elem)
 	{
-		auto index = m_linearizer(elem);
-
-		if (index.has_value())
-			return m_bitvector.insert(*index);
-		else
-			return m_set.insert(std::move(elem));
+		return dispatch(elem, [this](size_t index) { return m_bitvector.insert(index); },
+			[&] { return m_set.insert(sparse_element(std::move(elem))); });
 	}
 
 	bool erase(const T& elem)
 	{
-		auto index = m_linearizer(elem);
-
-		if (index.has_value())
-			return m_bitvector.erase(*index);
-		else
-			return m_set.erase(std::move(elem));
+		return dispatch(elem, [this](size_t index) { return m_bitvector.erase(index); },
+			[&] { return m_set.erase(sparse_element(elem)); });
 	}
 
 	bool contains(const T& elem)
 	{
-		auto index = m_linearizer(elem);
+		return dispatch(elem, [this](size_t index) { return m_bitvector.contains(index); },
+			[&] { return m_set.contains(sparse_element(elem)); });
+	}
 
-		if (index.has_value())
-			return m_bitvector.contains(*index);
+	bool insert_hashed(T elem, hash_type hash)
+	{
+		return dispatch(elem, [this](size_t index) { return m_bitvector.insert(index); },
+			[&] { return m_set.insert_hashed(sparse_element(std::move(elem)), hash); });
+	}
+
+	bool erase_hashed(const T& elem, hash_type hash)
+	{
+		return dispatch(elem, [this](size_t index) { return m_bitvector.erase(index); },
+			[&] { return m_set.erase_hashed(sparse_element(elem), hash); });
+	}
+
+	bool contains_hashed(const T& elem, hash_type hash)
+	{
+		return dispatch(elem, [this](size_t index) { return m_bitvector.contains(index); },
+			[&] { return m_set.contains_hashed(sparse_element(elem), hash); });
+	}
+
+	template<typename K> requires c_transparentKey<K>
+	bool erase(const K& key)
+	{
+		return dispatch(key, [this](size_t index) { return m_bitvector.erase(index); },
+			[&] { return m_set.erase(key); });
+	}
+
+	template<typename K> requires c_transparentKey<K>
+	bool contains(const K& key)
+	{
+		return dispatch(key, [this](size_t index) { return m_bitvector.contains(index); },
+			[&] { return m_set.contains(key); });
+	}
+
+	template<typename K> requires c_transparentKey<K>
+	bool erase_hashed(const K& key, hash_type hash)
+	{
+		return dispatch(key, [this](size_t index) { return m_bitvector.erase(index); },
+			[&] { return m_set.erase_hashed(key, hash); });
+	}
+
+	template<typename K> requires c_transparentKey<K>
+	bool contains_hashed(const K& key, hash_type hash)
+	{
+		return dispatch(key, [this](size_t index) { return m_bitvector.contains(index); },
+			[&] { return m_set.contains_hashed(key, hash); });
+	}
+
+	Hasher hash_function() const
+	{
+		if constexpr (c_counting)
+			return m_set.hash_function().hasher;
 		else
-			return m_set.contains(std::move(elem));
+			return m_set.hash_function();
+	}
+
+	// Increments the count of the element, and returns the new count
+	size_t increment(const T& elem) requires CountingSet<DenseSet>
+	{
+		return dispatch(elem, [this](size_t index) { return m_bitvector.increment(index); }, [&]
+		{
+			// The element can be inserted or erased by another thread between the two steps
+			while (true)
+			{
+				size_t count = 0;
+				bool found = m_set.update(Counted<T>{ elem }, [&count](Counted<T>& counted)
+				{
+					counted.count = std::min(counted.count + 1, DenseSet::c_maxCount);
+					count = counted.count;
+					return true;
+				});
+
+				if (found)
+					return count;
+				if (m_set.insert(Counted<T>{ elem }))
+					return size_t{ 1 };
+			}
+		});
+	}
+
+	// Decrements the count of the element if it is in the set, and returns the
+	// new count. The element is erased when the count reaches zero.
+	size_t decrement(const T& elem) requires CountingSet<DenseSet>
+	{
+		return dispatch(elem, [this](size_t index) { return m_bitvector.decrement(index); }, [&]
+		{
+			size_t count = 0;
+			m_set.update(Counted<T>{ elem }, [&count](Counted<T>& counted)
+			{
+				count = --counted.count;
+				return count != 0;
+			});
+
+			return count;
+		});
+	}
+
+	size_t count(const T& elem) requires CountingSet<DenseSet>
+	{
+		return dispatch(elem, [this](size_t index) { return m_bitvector.count(index); }, [&]
+		{
+			size_t count = 0;
+			m_set.update(Counted<T>{ elem }, [&count](Counted<T>& counted)
+			{
+				count = counted.count;
+				return true;
+			});
+
+			return count;
+		});
+	}
+
+	// Inserts every element of the box [min, max], and returns how many of them were new.
+	// The Linearizer has to provide for_each_run, which splits the box into contiguous
+	// ranges of indices and elements outside the linearized region.
+	size_t insert_box(const T& min, const T& max)
+	{
+		size_t inserted = 0;
+		m_linearizer.for_each_run(min, max,
+			[this, &inserted](size_t begin, size_t end)
+			{
+				inserted += m_bitvector.set_range(begin, end);
+			},
+			[this, &inserted](const T& elem)
+			{
+				inserted += m_set.insert(sparse_element(elem));
+			});
+
+		return inserted;
+	}
+
+	size_t size() const
+	{
+		return m_bitvector.size() + m_set.size();
+	}
+
+	// Erases every element. Must not run concurrently with other operations.
+	void clear()
+	{
+		m_bitvector.clear();
+		m_set.clear();
+	}
+
+	auto allocation_policy() const
+	{
+		return m_bitvector.allocation_policy();
+	}
+
+	// Calls f with the elements outside the linearized region, while the other
+	// operations continue; see HashSet::for_each. Needs the split-ordered backend.
+	template<typename F>
+	void for_each_sparse(F&& f)
+	{
+		m_set.for_each([&f](const auto& elem)
+		{
+			if constexpr (c_counting)
+				f(elem.value);
+			else
+				f(elem);
+		});
+	}
+
+	// A consistent snapshot of the elements outside the linearized region.
+	// Counting sets give the elements with their counts, as Counted<T>.
+	auto sparse_snapshot()
+	{
+		return m_set.snapshot();
+	}
+
+	// Pre-sizes the hash set of the elements outside the linearized region
+	void reserve(size_t count)
+	{
+		m_set.reserve(count);
+	}
+
+	void rehash(size_t bucketCount)
+	{
+		m_set.rehash(bucketCount);
+	}
+
+	// Releases the memory of the hash set after mass erases. Needs the split-ordered backend.
+	void shrink_to_fit()
+	{
+		m_set.shrink_to_fit();
 	}
 
 	float max_load_factor() const
@@ -52,7 +347,35 @@ public:
 	}
 
 private:
+	static constexpr bool c_counting = CountingSet<DenseSet>;
+
+	// Counting sets keep the counts of the elements outside the linearized region in the hash set
+	using SparseSet = std::conditional_t<c_counting,
+		typename SparseBackend::template Set<Counted<T>, BlockSize, CountedHasher<T, Hasher>, Concurrency>,
+		typename SparseBackend::template Set<T, BlockSize, Hasher, Concurrency>>;
+	static_assert(std::is_same_v<typename SparseSet::hash_type, hash_type>, "The hashes are passed through to the hash set");
+
+	static auto sparse_element(T elem)
+	{
+		if constexpr (c_counting)
+			return Counted<T>{ std::move(elem) };
+		else
+			return elem;
+	}
+
+	// Runs dense(index) for the elements in the linearized region, and sparse() for the others
+	template<typename K, typename Dense, typename Sparse>
+	auto dispatch(const K& elem, Dense&& dense, Sparse&& sparse)
+	{
+		auto index = m_linearizer(elem);
+
+		if (index.has_value())
+			return dense(*index);
+		else
+			return sparse();
+	}
+
 	Linearizer m_linearizer;
-	BitVectorSet m_bitvector;
-	HashSet<T, BlockSize, Hasher> m_set;
+	DenseSet m_bitvector;
+	SparseSet m_set;
 };
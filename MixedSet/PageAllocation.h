@@ -0,0 +1,447 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+enum class NumaPolicy
+{
+	Default,    // whatever the process policy is, usually first touch
+	Interleave, // pages are spread round-robin over the allowed nodes
+	Local,      // pages are bound to the node of the thread touching them first
+};
+
+// Requested placement of a PageAllocation. Both settings are hints:
+// PageAllocation::policy() reports which of them actually took effect.
+struct AllocationPolicy
+{
+	bool hugePages = false;
+	NumaPolicy numa = NumaPolicy::Default;
+};
+
+// An open file, whose sections can be mapped into memory by PageAllocation.
+// The mappings stay valid after the file is closed.
+class MappedFile
+{
+public:
+	enum class Mode
+	{
+		Create, // creates or truncates the file, then extends it with zeros to the requested size
+		Open,   // opens an existing file
+	};
+
+	// Offsets of the mapped sections have to be multiples of this
+	static constexpr size_t c_sectionAlignment = size_t{ 64 } << 10;
+
+	MappedFile(const std::filesystem::path& path, Mode mode, size_t bytes = 0)
+	{
+#ifdef _WIN32
+		m_handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+			mode == Mode::Create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_handle == INVALID_HANDLE_VALUE)
+			throw std::system_error(GetLastError(), std::system_category(), "Cannot open " + path.string());
+
+		if (mode == Mode::Create)
+		{
+			// Sparse files do not allocate the zeros on the disk
+			DWORD returned;
+			DeviceIoControl(m_handle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+
+			LARGE_INTEGER end;
+			end.QuadPart = static_cast<LONGLONG>(bytes);
+			if (!SetFilePointerEx(m_handle, end, nullptr, FILE_BEGIN) || !SetEndOfFile(m_handle))
+			{
+				auto error = GetLastError();
+				CloseHandle(m_handle);
+				throw std::system_error(error, std::system_category(), "Cannot resize " + path.string());
+			}
+		}
+
+		LARGE_INTEGER size;
+		GetFileSizeEx(m_handle, &size);
+		m_size = static_cast<size_t>(size.QuadPart);
+#else
+		m_descriptor = open(path.c_str(), mode == Mode::Create ? O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0644);
+		if (m_descriptor < 0)
+			throw std::system_error(errno, std::generic_category(), "Cannot open " + path.string());
+
+		// The file is extended with holes, which read as zeros and take no space
+		if (mode == Mode::Create && ftruncate(m_descriptor, static_cast<off_t>(bytes)) != 0)
+		{
+			int error = errno;
+			close(m_descriptor);
+			throw std::system_error(error, std::generic_category(), "Cannot resize " + path.string());
+		}
+
+		struct stat status;
+		fstat(m_descriptor, &status);
+		m_size = static_cast<size_t>(status.st_size);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		CloseHandle(m_handle);
+#else
+		close(m_descriptor);
+#endif
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+#ifdef _WIN32
+	HANDLE handle() const
+	{
+		return m_handle;
+	}
+#else
+	int descriptor() const
+	{
+		return m_descriptor;
+	}
+#endif
+
+private:
+#ifdef _WIN32
+	HANDLE m_handle;
+#else
+	int m_descriptor;
+#endif
+	size_t m_size = 0;
+};
+
+// Zero-initialized memory obtained directly from the OS.
+// The pages are not touched on allocation, so they are only
+// backed by physical memory once they are written.
+class PageAllocation
+{
+public:
+	// Regions at least this large do not reserve swap space up front
+	static constexpr size_t c_noReserveThreshold = size_t{ 1 } << 30;
+	static constexpr size_t c_hugePageSize = size_t{ 2 } << 20;
+
+	PageAllocation() = default;
+
+	explicit PageAllocation(size_t bytes, AllocationPolicy policy = {})
+	{
+		if (bytes == 0)
+			return;
+
+#ifdef _WIN32
+		// Large pages need a privilege on Windows and cannot be committed lazily, so they are not used
+		bytes = round_to_pages(bytes);
+		void* data = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (!data)
+			throw std::bad_alloc{};
+
+		m_data = data;
+		m_size = bytes;
+#else
+		// Huge pages can only back 2 MB aligned ranges
+		size_t alignment = policy.hugePages ? c_hugePageSize : page_size();
+		bytes = (bytes + alignment - 1) / alignment * alignment;
+		size_t mappedBytes = bytes + alignment - page_size();
+
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+		if (bytes >= c_noReserveThreshold)
+			flags |= MAP_NORESERVE;
+
+		void* data = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (data == MAP_FAILED)
+			throw std::bad_alloc{};
+
+		// Give back the unaligned head and tail of the mapping
+		auto* begin = static_cast<char*>(data);
+		auto* alignedBegin = begin + (alignment - reinterpret_cast<uintptr_t>(begin) % alignment) % alignment;
+		if (alignedBegin != begin)
+			munmap(begin, alignedBegin - begin);
+		if (auto tail = begin + mappedBytes - (alignedBegin + bytes); tail > 0)
+			munmap(alignedBegin + bytes, tail);
+
+		m_data = alignedBegin;
+		m_size = bytes;
+
+		apply_policy(policy);
+#endif
+	}
+
+	// Maps 'bytes' bytes of the file starting at 'offset', which has to be
+	// a multiple of MappedFile::c_sectionAlignment. Modifications are written
+	// back to the file, and the pages are only read from it on first access.
+	PageAllocation(const MappedFile& file, size_t offset, size_t bytes)
+	{
+		if (bytes == 0)
+			return;
+
+		if (offset % MappedFile::c_sectionAlignment != 0 || offset + bytes > file.size())
+			throw std::invalid_argument("The mapped section is not inside the file");
+
+#ifdef _WIN32
+		HANDLE mapping = CreateFileMappingW(file.handle(), nullptr, PAGE_READWRITE, 0, 0, nullptr);
+		if (!mapping)
+			throw std::system_error(GetLastError(), std::system_category(), "Cannot map file");
+
+		void* data = MapViewOfFile(mapping, FILE_MAP_WRITE, static_cast<DWORD>(uint64_t{ offset } >> 32), static_cast<DWORD>(offset), bytes);
+		auto error = GetLastError();
+		CloseHandle(mapping);
+		if (!data)
+			throw std::system_error(error, std::system_category(), "Cannot map file");
+
+		// Keeps the file open for flush
+		DuplicateHandle(GetCurrentProcess(), file.handle(), GetCurrentProcess(), &m_file, 0, FALSE, DUPLICATE_SAME_ACCESS);
+#else
+		void* data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file.descriptor(), static_cast<off_t>(offset));
+		if (data == MAP_FAILED)
+			throw std::system_error(errno, std::generic_category(), "Cannot map file");
+#endif
+		m_data = data;
+		m_size = bytes;
+		m_fileBacked = true;
+	}
+
+	PageAllocation(PageAllocation&& other) noexcept
+		: m_data(std::exchange(other.m_data, nullptr)),
+		m_size(std::exchange(other.m_size, 0)),
+		m_policy(std::exchange(other.m_policy, {})),
+		m_fileBacked(std::exchange(other.m_fileBacked, false))
+#ifdef _WIN32
+		, m_file(std::exchange(other.m_file, nullptr))
+#endif
+	{
+	}
+
+	PageAllocation& operator=(PageAllocation&& other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			m_data = std::exchange(other.m_data, nullptr);
+			m_size = std::exchange(other.m_size, 0);
+			m_policy = std::exchange(other.m_policy, {});
+			m_fileBacked = std::exchange(other.m_fileBacked, false);
+#ifdef _WIN32
+			m_file = std::exchange(other.m_file, nullptr);
+#endif
+		}
+		return *this;
+	}
+
+	~PageAllocation()
+	{
+		release();
+	}
+
+	void* data() const
+	{
+		return m_data;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	// The part of the requested policy that took effect
+	const AllocationPolicy& policy() const
+	{
+		return m_policy;
+	}
+
+	// Whether the memory is a mapping of a file
+	bool file_backed() const
+	{
+		return m_fileBacked;
+	}
+
+	// Writes the modified pages of a file mapping to the disk and waits for it.
+	// Returns false if the OS reported an error. Does nothing for anonymous memory.
+	bool flush()
+	{
+		if (!m_data || !m_fileBacked)
+			return true;
+
+#ifdef _WIN32
+		return FlushViewOfFile(m_data, m_size) && FlushFileBuffers(m_file);
+#else
+		return msync(m_data, m_size, MS_SYNC) == 0;
+#endif
+	}
+
+	static size_t page_size()
+	{
+#ifdef _WIN32
+		static const size_t pageSize = []
+		{
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			return static_cast<size_t>(info.dwPageSize);
+		}();
+#else
+		static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+		return pageSize;
+	}
+
+	static size_t round_to_pages(size_t bytes)
+	{
+		return (bytes + page_size() - 1) / page_size() * page_size();
+	}
+
+	// Sets the whole allocation to zero. The pages are handed back to the OS
+	// where possible, so that they become untouched zero pages again,
+	// otherwise they are cleared by several threads. Must not run concurrently
+	// with any other access to the memory. Throws if the pages given back on
+	// Windows cannot be committed again.
+	void clear()
+	{
+		if (!m_data)
+			return;
+
+		// File mappings would read the old contents back after MADV_DONTNEED,
+		// so their blocks are deallocated from the file instead
+#ifdef _WIN32
+		bool released = !m_fileBacked && VirtualFree(m_data, m_size, MEM_DECOMMIT);
+		// The decommitted pages cannot be zeroed anymore
+		if (released && !VirtualAlloc(m_data, m_size, MEM_COMMIT, PAGE_READWRITE))
+			throw std::system_error(GetLastError(), std::system_category(), "Cannot recommit the cleared pages");
+#elif defined(MADV_REMOVE)
+		bool released = madvise(m_data, m_size, m_fileBacked ? MADV_REMOVE : MADV_DONTNEED) == 0;
+#else
+		bool released = !m_fileBacked && madvise(m_data, m_size, MADV_DONTNEED) == 0;
+#endif
+		if (!released)
+			zero_parallel(m_data, m_size);
+	}
+
+	// Zeroes 'bytes' bytes, split between the hardware threads when it is large
+	static void zero_parallel(void* data, size_t bytes)
+	{
+		constexpr size_t minBytesPerThread = size_t{ 16 } << 20;
+		size_t threadCount = std::clamp<size_t>(bytes / minBytesPerThread, 1, std::max(1u, std::thread::hardware_concurrency()));
+		size_t bytesPerThread = (bytes + threadCount - 1) / threadCount;
+
+		auto zero = [data, bytes, bytesPerThread](size_t i)
+		{
+			size_t begin = i * bytesPerThread;
+			if (begin < bytes)
+				std::memset(static_cast<char*>(data) + begin, 0, std::min(bytesPerThread, bytes - begin));
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < threadCount; i++)
+			threads.emplace_back(zero, i);
+
+		zero(0);
+
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+private:
+#ifndef _WIN32
+	void apply_policy(AllocationPolicy requested)
+	{
+#ifdef MADV_HUGEPAGE
+		if (requested.hugePages)
+			m_policy.hugePages = madvise(m_data, m_size, MADV_HUGEPAGE) == 0;
+#endif
+
+		if (requested.numa != NumaPolicy::Default && bind_numa(requested.numa))
+			m_policy.numa = requested.numa;
+	}
+
+	// Uses the raw system calls, so that libnuma is not needed.
+	// Fails on kernels without NUMA support.
+	bool bind_numa(NumaPolicy numa)
+	{
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+		constexpr int mpolInterleave = 3;
+		constexpr int mpolLocal = 4;
+		constexpr unsigned long mpolFMemsAllowed = 1 << 2;
+
+		if (numa == NumaPolicy::Local)
+			return syscall(SYS_mbind, m_data, m_size, mpolLocal, nullptr, 0, 0) == 0;
+
+		unsigned long nodes[16] = {};
+		constexpr unsigned long maxNode = sizeof(nodes) * 8 + 1;
+
+		int mode = 0;
+		if (syscall(SYS_get_mempolicy, &mode, nodes, maxNode, nullptr, mpolFMemsAllowed) != 0)
+			return false;
+
+		// Interleaving over a single node would not change anything
+		size_t nodeCount = 0;
+		for (auto mask : nodes)
+			nodeCount += std::popcount(mask);
+		if (nodeCount < 2)
+			return false;
+
+		return syscall(SYS_mbind, m_data, m_size, mpolInterleave, nodes, maxNode, 0) == 0;
+#else
+		(void)numa;
+		return false;
+#endif
+	}
+#endif
+
+	void release()
+	{
+		if (!m_data)
+			return;
+
+#ifdef _WIN32
+		if (m_fileBacked)
+		{
+			UnmapViewOfFile(m_data);
+			CloseHandle(m_file);
+			m_file = nullptr;
+		}
+		else
+			VirtualFree(m_data, 0, MEM_RELEASE);
+#else
+		munmap(m_data, m_size);
+#endif
+		m_data = nullptr;
+		m_size = 0;
+		m_fileBacked = false;
+	}
+
+	void* m_data = nullptr;
+	size_t m_size = 0;
+	AllocationPolicy m_policy;
+	bool m_fileBacked = false;
+#ifdef _WIN32
+	HANDLE m_file = nullptr;
+#endif
+};
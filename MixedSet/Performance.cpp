@@ -36,19 +36,34 @@ namespace
 			return RandomVec3Helper(r + 1, r * m);
 		}
 	}
+
+	std::string ToString(const AllocationPolicy& policy)
+	{
+		constexpr const char* numaNames[] = { "default", "interleave", "local" };
+		return std::string(policy.hugePages ? "huge pages" : "regular pages")
+			+ ", " + numaNames[static_cast<int>(policy.numa)] + " NUMA placement";
+	}
 }
 
+// 'policy', if given, is the requested allocation policy of the set,
+// and it receives the policy that took effect
 template<
 	size_t HalfWidth,
 	size_t BlockSize,
-	unsigned InnerPointsPercentage
+	unsigned InnerPointsPercentage,
+	typename Concurrency = ConcurrencyPolicy::Concurrent,
+	typename SparseBackend = SplitOrderedBackend<>
 >
-double Benchmark(size_t vecNo, size_t threadNo, float maxLoadFactor)
+double Benchmark(size_t vecNo, size_t threadNo, float maxLoadFactor, AllocationPolicy* policy = nullptr)
 {
 	constexpr static int width = 2 * HalfWidth;
 	constexpr static float p = InnerPointsPercentage / 100.f;
-	MixedSet<vec3, Vec3Linearizer<HalfWidth>, BlockSize> set;
+	MixedSet<vec3, Vec3Linearizer<HalfWidth>, BlockSize, std::hash<vec3>, Concurrency,
+		BitVectorSet<ReleaseOrdering, Concurrency>, SparseBackend> set({}, policy ? *policy : AllocationPolicy{});
 	set.max_load_factor(maxLoadFactor);
+	set.reserve(static_cast<size_t>(vecNo * (1 - p)));
+	if (policy)
+		*policy = set.allocation_policy();
 	std::vector<std::thread> threads(threadNo);
 
 	auto start = std::chrono::system_clock::now();
@@ -75,7 +90,9 @@ double Benchmark(size_t vecNo, size_t threadNo, float maxLoadFactor)
 template<
 	size_t HalfWidth,
 	size_t BlockSize,
-	unsigned InnerPointsPercentage
+	unsigned InnerPointsPercentage,
+	typename Concurrency = ConcurrencyPolicy::Concurrent,
+	typename SparseBackend = SplitOrderedBackend<>
 >
 void RunTests(size_t vecNo, size_t minThreads, size_t maxThreads, float maxLoadFactor = 512.)
 {
@@ -90,7 +107,7 @@ void RunTests(size_t vecNo, size_t minThreads, size_t maxThreads, float maxLoadF
 			<< inner << " inner points approx.\n"
 			<< outer << " outer points approx.\n"
 			<< maxLoadFactor << " max load factor.\n"
-			<< Benchmark<HalfWidth, BlockSize, InnerPointsPercentage>(vecNo, i, maxLoadFactor)
+			<< Benchmark<HalfWidth, BlockSize, InnerPointsPercentage, Concurrency, SparseBackend>(vecNo, i, maxLoadFactor)
 			<< " seconds" << std::endl;
 	}
 }
@@ -105,6 +122,75 @@ void RunForAllThreads(size_t vecNo, float maxLoadFactor = 512.)
 	size_t threadNo = 2 * std::thread::hardware_concurrency();
 	RunTests<HalfWidth, BlockSize, InnerPointsPercentage>(vecNo, threadNo, threadNo, maxLoadFactor);
 }
+
+template<
+	size_t HalfWidth,
+	unsigned InnerPointsPercentage,
+	size_t BlockSize
+>
+void RunWithAllocationPolicy(size_t vecNo, AllocationPolicy policy)
+{
+	size_t threadNo = 2 * std::thread::hardware_concurrency();
+	std::cout
+		<< "====================================\n"
+		<< threadNo << " threads\n"
+		<< ToString(policy) << " requested\n";
+	double seconds = Benchmark<HalfWidth, BlockSize, InnerPointsPercentage>(vecNo, threadNo, 512., &policy);
+	std::cout
+		<< ToString(policy) << " used\n"
+		<< seconds << " seconds" << std::endl;
+}
+
+// Inserts every index of a BitVectorSet, with the threads taking turns
+// on adjacent indices, so that they all write the same cache lines
+double ClusteredInsertBenchmark(size_t size, size_t threadNo, bool combine)
+{
+	BitVectorSet<> set(size);
+	std::vector<std::thread> threads(threadNo);
+
+	auto start = std::chrono::system_clock::now();
+
+	for (size_t t = 0; t < threadNo; t++)
+	{
+		threads[t] = std::thread([&set, size, threadNo, t, combine]
+		{
+			if (combine)
+			{
+				BitVectorSet<>::WriteCombiner combiner(set);
+				for (size_t i = t; i < size; i += threadNo)
+					combiner.insert(i);
+			}
+			else
+			{
+				for (size_t i = t; i < size; i += threadNo)
+					set.insert(i);
+			}
+		});
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	auto end = std::chrono::system_clock::now();
+	return std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
+}
+
+void RunClusteredInsert(size_t size)
+{
+	size_t threadNo = std::thread::hardware_concurrency();
+	for (bool combine : { false, true })
+	{
+		std::cout
+			<< "====================================\n"
+			<< threadNo << " threads\n"
+			<< (combine ? "with" : "without") << " write combining\n"
+			<< ClusteredInsertBenchmark(size, threadNo, combine)
+			<< " seconds" << std::endl;
+	}
+}
+
 void PerformanceTest()
 {
 	constexpr size_t vecNo = 100'000'000;
@@ -151,4 +237,21 @@ void PerformanceTest()
 	RunForAllThreads<600,  80, 256>(vecNo);
 	RunForAllThreads<600,  90, 256>(vecNo);
 	RunForAllThreads<600, 100, 256>(vecNo);
+
+	title("Testing for the single threaded policy");
+	RunTests<600, 256, 50, ConcurrencyPolicy::Concurrent>(vecNo / 10, 1, 1);
+	RunTests<600, 256, 50, ConcurrencyPolicy::Single>(vecNo / 10, 1, 1);
+
+	title("Testing for allocation policies");
+	RunWithAllocationPolicy<600, 100, 256>(vecNo, {});
+	RunWithAllocationPolicy<600, 100, 256>(vecNo, { true, NumaPolicy::Default });
+	RunWithAllocationPolicy<600, 100, 256>(vecNo, { true, NumaPolicy::Interleave });
+	RunWithAllocationPolicy<600, 100, 256>(vecNo, { true, NumaPolicy::Local });
+
+	title("Testing for the hash set backends");
+	RunTests<600, 256, 0, ConcurrencyPolicy::Concurrent, SplitOrderedBackend<>>(vecNo, threadNo, threadNo);
+	RunTests<600, 256, 0, ConcurrencyPolicy::Concurrent, SwissBackend>(vecNo, threadNo, threadNo, SwissHashSet<vec3>::c_maxLoadFactor);
+
+	title("Testing for write combining of clustered inserts");
+	RunClusteredInsert(vecNo * 10);
 }
\ No newline at end of file
@@ -0,0 +1,502 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <variant>
+#include <vector>
+#include "PageAllocation.h"
+#include "ConcurrencyPolicy.h"
+
+// A set of indices in [0, size), which stores the indices in compressed form.
+// It has the operations of BitVectorSet which MixedSet uses as its DenseSet:
+// insert, erase, contains, set_range, clear, size and allocation_policy; the
+// others, like the iteration, the rank queries and the set algebra, are
+// only provided by BitVectorSet.
+// The range is split into chunks of 2^16 indices, and each chunk uses the
+// smallest of three containers: a sorted array of the present indices, a
+// bitmap, or a sorted list of runs.
+// This uses a small fraction of the memory of a BitVectorSet for sparse
+// sets, at the cost of slower lookups. Each chunk has its own lock.
+template<typename Concurrency = ConcurrencyPolicy::Concurrent>
+class RoaringSet
+{
+	using Low = uint16_t;
+	static constexpr size_t c_chunkBits = 16;
+	static constexpr size_t c_chunkSize = size_t{ 1 } << c_chunkBits;
+
+	// An array is used up to this many elements, a bitmap above it
+	static constexpr size_t c_arrayMax = 4096;
+	// A bitmap is only turned back into an array when it becomes
+	// much smaller, so alternating inserts and erases don't convert every time
+	static constexpr size_t c_bitmapMin = c_arrayMax / 2;
+	// A run container with more runs than this is larger than a bitmap
+	static constexpr size_t c_runMax = 2048;
+
+	struct ArrayContainer
+	{
+		std::vector<Low> values;
+
+		size_t cardinality() const
+		{
+			return values.size();
+		}
+
+		bool contains(Low value) const
+		{
+			return std::binary_search(values.begin(), values.end(), value);
+		}
+
+		bool insert(Low value)
+		{
+			auto iter = std::lower_bound(values.begin(), values.end(), value);
+			if (iter != values.end() && *iter == value)
+				return false;
+
+			values.insert(iter, value);
+			return true;
+		}
+
+		bool erase(Low value)
+		{
+			auto iter = std::lower_bound(values.begin(), values.end(), value);
+			if (iter == values.end() || *iter != value)
+				return false;
+
+			values.erase(iter);
+			return true;
+		}
+
+		template<typename F>
+		void for_each(F&& f) const
+		{
+			for (auto value : values)
+				f(value);
+		}
+	};
+
+	struct BitmapContainer
+	{
+		static constexpr size_t c_words = c_chunkSize / 64;
+
+		std::unique_ptr<std::array<uint64_t, c_words>> words = std::make_unique<std::array<uint64_t, c_words>>();
+		size_t count = 0;
+
+		size_t cardinality() const
+		{
+			return count;
+		}
+
+		bool contains(Low value) const
+		{
+			return ((*words)[value / 64] >> (value % 64)) & 1;
+		}
+
+		bool insert(Low value)
+		{
+			uint64_t& word = (*words)[value / 64];
+			uint64_t mask = uint64_t{ 1 } << (value % 64);
+			if (word & mask)
+				return false;
+
+			word |= mask;
+			count++;
+			return true;
+		}
+
+		bool erase(Low value)
+		{
+			uint64_t& word = (*words)[value / 64];
+			uint64_t mask = uint64_t{ 1 } << (value % 64);
+			if (!(word & mask))
+				return false;
+
+			word &= ~mask;
+			count--;
+			return true;
+		}
+
+		template<typename F>
+		void for_each(F&& f) const
+		{
+			for (size_t w = 0; w < c_words; w++)
+			{
+				for (uint64_t bits = (*words)[w]; bits; bits &= bits - 1)
+					f(static_cast<Low>(w * 64 + std::countr_zero(bits)));
+			}
+		}
+	};
+
+	struct RunContainer
+	{
+		// Inclusive ranges, sorted and neither overlapping nor touching
+		struct Run
+		{
+			Low first;
+			Low last;
+		};
+
+		std::vector<Run> runs;
+		size_t count = 0;
+
+		size_t cardinality() const
+		{
+			return count;
+		}
+
+		// The last run starting at or before 'value', or runs.end()
+		auto find(Low value) const
+		{
+			auto iter = std::upper_bound(runs.begin(), runs.end(), value, [](Low v, const Run& run)
+			{
+				return v < run.first;
+			});
+			return iter == runs.begin() ? runs.end() : iter - 1;
+		}
+
+		bool contains(Low value) const
+		{
+			auto iter = find(value);
+			return iter != runs.end() && value <= iter->last;
+		}
+
+		bool insert(Low value)
+		{
+			return insert_range(value, value) > 0;
+		}
+
+		// Inserts [first, last], and returns the number of new elements
+		size_t insert_range(Low first, Low last)
+		{
+			// Runs overlapping or touching the new one are merged into it
+			auto begin = std::lower_bound(runs.begin(), runs.end(), first, [](const Run& run, Low v)
+			{
+				return run.last + 1 < v;
+			});
+			auto end = begin;
+			size_t covered = 0;
+			Run merged{ first, last };
+			for (; end != runs.end() && end->first <= last + 1; ++end)
+			{
+				covered += end->last - end->first + 1;
+				merged.first = std::min(merged.first, end->first);
+				merged.last = std::max(merged.last, end->last);
+			}
+
+			// The merged run consists of the old runs and the new elements
+			size_t inserted = (merged.last - merged.first + 1) - covered;
+
+			auto iter = runs.erase(begin, end);
+			runs.insert(iter, merged);
+			count += inserted;
+			return inserted;
+		}
+
+		bool erase(Low value)
+		{
+			auto iter = std::upper_bound(runs.begin(), runs.end(), value, [](Low v, const Run& run)
+			{
+				return v < run.first;
+			});
+			if (iter == runs.begin() || (iter - 1)->last < value)
+				return false;
+
+			auto& run = *(iter - 1);
+			if (run.first == run.last)
+				runs.erase(iter - 1);
+			else if (value == run.first)
+				run.first++;
+			else if (value == run.last)
+				run.last--;
+			else
+			{
+				Run upper{ static_cast<Low>(value + 1), run.last };
+				run.last = value - 1;
+				runs.insert(iter, upper);
+			}
+
+			count--;
+			return true;
+		}
+
+		template<typename F>
+		void for_each(F&& f) const
+		{
+			for (auto& run : runs)
+			{
+				for (size_t value = run.first; value <= run.last; value++)
+					f(static_cast<Low>(value));
+			}
+		}
+	};
+
+	struct Chunk
+	{
+		mutable typename Concurrency::Mutex mutex;
+		std::variant<ArrayContainer, BitmapContainer, RunContainer> container;
+	};
+
+public:
+	RoaringSet(size_t size, AllocationPolicy = {})
+		: m_chunks(std::make_unique<Chunk[]>((size + c_chunkSize - 1) / c_chunkSize)), m_size(size)
+	{
+	}
+
+	bool insert(size_t index)
+	{
+		if (index >= m_size)
+			return false;
+
+		auto& chunk = m_chunks[index >> c_chunkBits];
+		std::unique_lock lock{ chunk.mutex };
+
+		bool inserted = std::visit([index](auto& container)
+		{
+			return container.insert(static_cast<Low>(index));
+		}, chunk.container);
+
+		if (inserted)
+		{
+			convert_if_needed(chunk);
+			m_count.add(1);
+		}
+		return inserted;
+	}
+
+	bool erase(size_t index)
+	{
+		if (index >= m_size)
+			return false;
+
+		auto& chunk = m_chunks[index >> c_chunkBits];
+		std::unique_lock lock{ chunk.mutex };
+
+		bool erased = std::visit([index](auto& container)
+		{
+			return container.erase(static_cast<Low>(index));
+		}, chunk.container);
+
+		if (erased)
+		{
+			convert_if_needed(chunk);
+			m_count.add(-1);
+		}
+		return erased;
+	}
+
+	bool contains(size_t index) const
+	{
+		if (index >= m_size)
+			return false;
+
+		auto& chunk = m_chunks[index >> c_chunkBits];
+		std::shared_lock lock{ chunk.mutex };
+
+		return std::visit([index](auto& container)
+		{
+			return container.contains(static_cast<Low>(index));
+		}, chunk.container);
+	}
+
+	// Inserts every index in [begin, end), and returns how many of them were not in the set.
+	// Whole chunks become a single run.
+	size_t set_range(size_t begin, size_t end)
+	{
+		end = std::min(end, m_size);
+		size_t inserted = 0;
+
+		while (begin < end)
+		{
+			size_t chunkEnd = std::min(end, (begin | (c_chunkSize - 1)) + 1);
+			auto& chunk = m_chunks[begin >> c_chunkBits];
+			std::unique_lock lock{ chunk.mutex };
+
+			Low first = static_cast<Low>(begin);
+			Low last = static_cast<Low>(chunkEnd - 1);
+
+			if (chunkEnd - begin > c_arrayMax && !std::holds_alternative<RunContainer>(chunk.container))
+				chunk.container = to_runs(chunk.container);
+
+			if (auto* runs = std::get_if<RunContainer>(&chunk.container))
+			{
+				inserted += runs->insert_range(first, last);
+			}
+			else
+			{
+				for (size_t value = first; value <= last; value++)
+				{
+					inserted += std::visit([value](auto& container)
+					{
+						return container.insert(static_cast<Low>(value));
+					}, chunk.container);
+
+					convert_if_needed(chunk);
+				}
+			}
+
+			convert_if_needed(chunk);
+			begin = chunkEnd;
+		}
+
+		m_count.add(static_cast<std::ptrdiff_t>(inserted));
+		return inserted;
+	}
+
+	// Erases every element
+	void clear()
+	{
+		for (size_t i = 0; i < chunk_count(); i++)
+		{
+			auto& chunk = m_chunks[i];
+			std::unique_lock lock{ chunk.mutex };
+			chunk.container = ArrayContainer{};
+		}
+
+		m_count.reset();
+	}
+
+	// Converts every chunk to its smallest representation, which turns
+	// chunks made of long runs of consecutive indices into run containers
+	void optimize()
+	{
+		for (size_t i = 0; i < chunk_count(); i++)
+		{
+			auto& chunk = m_chunks[i];
+			std::unique_lock lock{ chunk.mutex };
+
+			auto runs = to_runs(chunk.container);
+			size_t cardinality = runs.cardinality();
+			size_t runBytes = runs.runs.size() * sizeof(typename RunContainer::Run);
+			size_t arrayBytes = cardinality * sizeof(Low);
+			size_t bitmapBytes = c_chunkSize / 8;
+
+			if (runBytes < std::min(arrayBytes, bitmapBytes))
+				chunk.container = std::move(runs);
+			else if (cardinality <= c_arrayMax)
+				chunk.container = to_array(chunk.container);
+			else
+				chunk.container = to_bitmap(chunk.container);
+		}
+	}
+
+	size_t size() const
+	{
+		return static_cast<size_t>(std::max<std::ptrdiff_t>(m_count.load(), 0));
+	}
+
+	size_t capacity() const
+	{
+		return m_size;
+	}
+
+	// Approximate number of bytes used by the set
+	size_t memory_usage() const
+	{
+		size_t bytes = sizeof(*this) + chunk_count() * sizeof(Chunk);
+		for (size_t i = 0; i < chunk_count(); i++)
+		{
+			auto& chunk = m_chunks[i];
+			std::shared_lock lock{ chunk.mutex };
+
+			if (auto* array = std::get_if<ArrayContainer>(&chunk.container))
+				bytes += array->values.capacity() * sizeof(Low);
+			else if (auto* runs = std::get_if<RunContainer>(&chunk.container))
+				bytes += runs->runs.capacity() * sizeof(typename RunContainer::Run);
+			else
+				bytes += c_chunkSize / 8;
+		}
+		return bytes;
+	}
+
+	// The containers are allocated on the heap, so no allocation policy is applied
+	AllocationPolicy allocation_policy() const
+	{
+		return {};
+	}
+
+private:
+	size_t chunk_count() const
+	{
+		return (m_size + c_chunkSize - 1) / c_chunkSize;
+	}
+
+	// Assumption: the chunk is locked exclusively.
+	static void convert_if_needed(Chunk& chunk)
+	{
+		auto& container = chunk.container;
+		if (auto* array = std::get_if<ArrayContainer>(&container))
+		{
+			if (array->cardinality() > c_arrayMax)
+				container = to_bitmap(container);
+		}
+		else if (auto* bitmap = std::get_if<BitmapContainer>(&container))
+		{
+			if (bitmap->cardinality() < c_bitmapMin)
+				container = to_array(container);
+		}
+		else if (auto* runs = std::get_if<RunContainer>(&container))
+		{
+			if (runs->runs.size() <= c_runMax)
+				return;
+
+			if (runs->cardinality() <= c_arrayMax)
+				container = to_array(container);
+			else
+				container = to_bitmap(container);
+		}
+	}
+
+	template<typename Container, typename Variant>
+	static Container convert(const Variant& container)
+	{
+		Container result;
+		std::visit([&result](auto& source)
+		{
+			source.for_each([&result](Low value)
+			{
+				result.insert(value);
+			});
+		}, container);
+		return result;
+	}
+
+	template<typename Variant>
+	static ArrayContainer to_array(const Variant& container)
+	{
+		if (auto* array = std::get_if<ArrayContainer>(&container))
+			return *array;
+		return convert<ArrayContainer>(container);
+	}
+
+	template<typename Variant>
+	static BitmapContainer to_bitmap(const Variant& container)
+	{
+		return convert<BitmapContainer>(container);
+	}
+
+	template<typename Variant>
+	static RunContainer to_runs(const Variant& container)
+	{
+		RunContainer result;
+		std::visit([&result](auto& source)
+		{
+			// The values come in increasing order, so they extend the last run or start a new one
+			source.for_each([&result](Low value)
+			{
+				if (!result.runs.empty() && result.runs.back().last + 1 == value)
+					result.runs.back().last = value;
+				else
+					result.runs.push_back({ value, value });
+				result.count++;
+			});
+		}, container);
+		return result;
+	}
+
+	std::unique_ptr<Chunk[]> m_chunks;
+	size_t m_size;
+	typename Concurrency::Counter m_count;
+};
@@ -0,0 +1,68 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// A counter which is cheap to update from many threads at the same time.
+// Each thread updates one of several cache line sized shards, and
+// reading the value sums all of them. When a shard drifts more than
+// c_batch from zero, it is moved to a global value, which can be read
+// on its own as an approximation of the sum.
+class ShardedCounter
+{
+public:
+	static constexpr size_t c_shards = 64;
+	static constexpr std::ptrdiff_t c_batch = 64;
+	// approximate() differs from load() by less than this
+	static constexpr std::ptrdiff_t c_maxError = c_shards * c_batch;
+
+	void add(std::ptrdiff_t delta)
+	{
+		auto& shard = m_shards[shard_index()].value;
+		std::ptrdiff_t value = shard.fetch_add(delta, std::memory_order_relaxed) + delta;
+		if (value >= c_batch || value <= -c_batch)
+			m_global.fetch_add(shard.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
+	// Reads a single cache line, and differs from load() by less than c_maxError
+	std::ptrdiff_t approximate() const
+	{
+		return m_global.load(std::memory_order_relaxed);
+	}
+
+	// The sum of all changes. Updates running concurrently can
+	// be counted in any order, so the result is only exact when
+	// there are none.
+	std::ptrdiff_t load() const
+	{
+		std::ptrdiff_t sum = m_global.load(std::memory_order_relaxed);
+		for (auto& shard : m_shards)
+			sum += shard.value.load(std::memory_order_relaxed);
+
+		return sum;
+	}
+
+	void reset()
+	{
+		for (auto& shard : m_shards)
+			shard.value.store(0, std::memory_order_relaxed);
+		m_global.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	struct alignas(64) Shard
+	{
+		std::atomic<std::ptrdiff_t> value{ 0 };
+	};
+
+	// Threads are assigned to the shards in a round-robin fashion
+	static size_t shard_index()
+	{
+		static std::atomic<size_t> nextIndex{ 0 };
+		thread_local const size_t index = nextIndex.fetch_add(1, std::memory_order_relaxed) % c_shards;
+		return index;
+	}
+
+	alignas(64) std::atomic<std::ptrdiff_t> m_global{ 0 };
+	std::array<Shard, c_shards> m_shards;
+};
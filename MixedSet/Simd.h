@@ -0,0 +1,101 @@
+#pragma once
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define MIXEDSET_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// ThreadSanitizer does not recognize the vector loads of atomics, so the
+// code which uses them falls back to atomic loads in its builds
+#if defined(__SANITIZE_THREAD__)
+#define MIXEDSET_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define MIXEDSET_TSAN 1
+#endif
+#endif
+
+// Marks a function to be compiled for the given instruction set, so that
+// it can be selected at runtime. MSVC allows intrinsics anywhere.
+#if defined(MIXEDSET_X86) && !defined(_MSC_VER)
+#define MIXEDSET_TARGET(isa) __attribute__((target(isa)))
+#else
+#define MIXEDSET_TARGET(isa)
+#endif
+
+namespace Simd
+{
+	struct CpuFeatures
+	{
+		bool avx2 = false;
+		bool avx512 = false;
+	};
+
+	inline CpuFeatures detect_cpu_features()
+	{
+		CpuFeatures features;
+#if defined(MIXEDSET_X86) && defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 0);
+		if (regs[0] < 7)
+			return features;
+
+		__cpuid(regs, 1);
+		bool osxsave = regs[2] & (1 << 27);
+		if (!osxsave)
+			return features;
+
+		// The OS has to save the ymm (and zmm) registers on context switches
+		auto xcr0 = _xgetbv(0);
+		bool ymmEnabled = (xcr0 & 0x06) == 0x06;
+		bool zmmEnabled = (xcr0 & 0xe6) == 0xe6;
+
+		__cpuidex(regs, 7, 0);
+		features.avx2 = ymmEnabled && (regs[1] & (1 << 5));
+		features.avx512 = zmmEnabled && (regs[1] & (1 << 16));
+#elif defined(MIXEDSET_X86)
+		__builtin_cpu_init();
+		features.avx2 = __builtin_cpu_supports("avx2");
+		features.avx512 = __builtin_cpu_supports("avx512f");
+#endif
+		return features;
+	}
+
+	inline const CpuFeatures& cpu_features()
+	{
+		static const CpuFeatures features = detect_cpu_features();
+		return features;
+	}
+
+	inline void prefetch(const void* address)
+	{
+#if defined(MIXEDSET_X86)
+		_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+		__builtin_prefetch(address);
+#endif
+	}
+
+	// Tells the CPU that the thread is spinning, which saves power and
+	// lets the other hyper-thread of the core run
+	inline void pause()
+	{
+#if defined(MIXEDSET_X86)
+		_mm_pause();
+#elif defined(__aarch64__) && defined(__GNUC__)
+		asm volatile("yield");
+#endif
+	}
+
+	inline void prefetch_for_write(const void* address)
+	{
+#if defined(__GNUC__)
+		__builtin_prefetch(address, 1);
+#else
+		prefetch(address);
+#endif
+	}
+}
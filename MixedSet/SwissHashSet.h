@@ -0,0 +1,592 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "ConcurrencyPolicy.h"
+#include "HashTraits.h"
+#include "Simd.h"
+
+// A concurrent open addressing hash set in the style of Swiss tables.
+// Every slot has a control byte, which is empty, deleted, claimed by an
+// insert, or holds 7 bits of the hash of the element. The control bytes of
+// a group of 16 slots are compared to the hash at once with SSE2.
+//
+// contains takes no locks. insert and erase lock one of c_stripes mutexes
+// chosen by the hash, so the operations on the same element are serialized,
+// and they claim empty slots by compare-and-swap, since other elements can
+// compete for the same slot. Erasing leaves a deleted marker, and the slot
+// is only reused after a rebuild, so the elements never move while a lookup
+// reads them. The table is rebuilt with all the stripes locked. If it does
+// not have to grow, the deleted markers which no probe sequence passes are
+// turned back to empty slots in place, otherwise the elements are copied
+// into a new table. Both wait for the lookups which started before them:
+// the lookups count themselves in the reader counters of the current epoch,
+// and the rebuild starts a new epoch and waits until the counters of the
+// previous one drop to zero. Then the old table is freed.
+// The *_hashed operations and the lookups by other key types are described
+// in HashTraits.h; the keys are compared with the elements by ==.
+template<
+	typename T,
+	class Hasher = std::hash<T>,
+	typename Concurrency = ConcurrencyPolicy::Concurrent
+>
+class SwissHashSet
+{
+	using Mutex = typename Concurrency::Mutex;
+	using UniqueLock = std::unique_lock<Mutex>;
+	using Control = int8_t;
+
+	static constexpr size_t c_groupSize = 16;
+	static constexpr size_t c_stripes = 64;
+
+	static constexpr Control c_empty = -128;
+	static constexpr Control c_deleted = -2;
+	static constexpr Control c_claimed = -1;
+
+	// An insert which has to probe more groups than this grows the table
+	static constexpr size_t c_maxProbeGroups = 16;
+
+public:
+	using hash_type = std::size_t;
+
+	// The fraction of the slots which can be used before the table grows
+	static constexpr float c_maxLoadFactor = 0.875f;
+
+	SwissHashSet(size_t startSize = 32, Hasher hasher = {})
+		: m_hasher(std::move(hasher))
+	{
+		publish(std::make_unique<Table>(group_count(startSize)));
+	}
+
+	SwissHashSet(const SwissHashSet&) = delete;
+	SwissHashSet& operator=(const SwissHashSet&) = delete;
+
+	bool insert(T elem)
+	{
+		const hash_type hash = m_hasher(elem);
+		return insert_hashed(std::move(elem), hash);
+	}
+
+	bool insert_hashed(T elem, hash_type hashValue)
+	{
+		const size_t hash = mix(hashValue);
+
+		while (true)
+		{
+			Table* table;
+			{
+				UniqueLock lock{ stripe(hash) };
+				table = m_table.load(std::memory_order_acquire);
+
+				if (find(*table, hash, elem))
+					return false;
+
+				if (auto slot = claim(*table, hash))
+				{
+					table->m_slots[*slot] = std::move(elem);
+					table->m_control[*slot].store(h2(hash), std::memory_order_release);
+					m_size.add(1);
+					return true;
+				}
+			}
+
+			grow(table);
+		}
+	}
+
+	bool erase(const T& elem)
+	{
+		return erase_hashed(elem, m_hasher(elem));
+	}
+
+	bool erase_hashed(const T& elem, hash_type hashValue)
+	{
+		return update_hashed(elem, hashValue, [](T&)
+		{
+			return false;
+		});
+	}
+
+	bool contains(const T& elem) const
+	{
+		return contains_hashed(elem, m_hasher(elem));
+	}
+
+	bool contains_hashed(const T& elem, hash_type hashValue) const
+	{
+		return lookup(elem, hashValue);
+	}
+
+	template<typename K> requires TransparentHasher<Hasher>
+	bool erase(const K& key)
+	{
+		return erase_hashed(key, m_hasher(key));
+	}
+
+	template<typename K> requires TransparentHasher<Hasher>
+	bool erase_hashed(const K& key, hash_type hashValue)
+	{
+		return update_key(key, hashValue, [](T&)
+		{
+			return false;
+		});
+	}
+
+	template<typename K> requires TransparentHasher<Hasher>
+	bool contains(const K& key) const
+	{
+		return contains_hashed(key, m_hasher(key));
+	}
+
+	template<typename K> requires TransparentHasher<Hasher>
+	bool contains_hashed(const K& key, hash_type hashValue) const
+	{
+		return lookup(key, hashValue);
+	}
+
+	// Calls f with the stored element equal to 'elem', and erases the element
+	// if f returns false. f must not change the hash or the equality of the
+	// element, because lookups can read it at the same time.
+	// Returns false if there is no such element.
+	template<typename F>
+	bool update(const T& elem, F&& f)
+	{
+		return update_hashed(elem, m_hasher(elem), std::forward<F>(f));
+	}
+
+	template<typename F>
+	bool update_hashed(const T& elem, hash_type hashValue, F&& f)
+	{
+		return update_key(elem, hashValue, std::forward<F>(f));
+	}
+
+	// Exact when no modifications run concurrently
+	size_t size() const
+	{
+		return static_cast<size_t>(std::max<std::ptrdiff_t>(m_size.load(), 0));
+	}
+
+	// Erases every element, but keeps the capacity.
+	// Must not run concurrently with other operations.
+	void clear()
+	{
+		size_t groupCount = m_table.load(std::memory_order_relaxed)->m_groupCount;
+		publish(std::make_unique<Table>(groupCount));
+		m_size.reset();
+		m_used.reset();
+	}
+
+	// Grows the table to at least 'slotCount' slots, rounded up to a power of two
+	void rehash(size_t slotCount)
+	{
+		std::array<UniqueLock, c_stripes> locks;
+		lock_all(locks);
+
+		Table& table = *m_table.load(std::memory_order_relaxed);
+		if (group_count(slotCount) > table.m_groupCount)
+			rebuild(table, group_count(slotCount));
+	}
+
+	void reserve(size_t count)
+	{
+		rehash(static_cast<size_t>(std::ceil(count / max_load_factor())));
+	}
+
+	Hasher hash_function() const
+	{
+		return m_hasher;
+	}
+
+	size_t bucket_count() const
+	{
+		return m_table.load(std::memory_order_acquire)->m_groupCount * c_groupSize;
+	}
+
+	float load_factor() const
+	{
+		return size() / static_cast<float>(bucket_count());
+	}
+
+	float max_load_factor() const
+	{
+		return m_maxLoadFactor;
+	}
+
+	// Open addressing needs free slots, so the value is clamped to c_maxLoadFactor
+	void max_load_factor(float ml)
+	{
+		m_maxLoadFactor = std::clamp(ml, 0.25f, c_maxLoadFactor);
+	}
+
+private:
+	struct Table
+	{
+		explicit Table(size_t groupCount)
+			: m_groupCount(groupCount),
+			m_control(new std::atomic<Control>[groupCount * c_groupSize]),
+			m_slots(new T[groupCount * c_groupSize])
+		{
+			for (size_t i = 0; i < groupCount * c_groupSize; i++)
+				m_control[i].store(c_empty, std::memory_order_relaxed);
+		}
+
+		size_t m_groupCount;
+		std::unique_ptr<std::atomic<Control>[]> m_control;
+		std::unique_ptr<T[]> m_slots;
+	};
+
+	struct alignas(64) Stripe
+	{
+		Mutex m_mutex;
+	};
+
+	struct alignas(64) ReaderCount
+	{
+		std::atomic<std::ptrdiff_t> m_count = 0;
+	};
+
+	// Keeps a lookup counted in the reader counters of an epoch until it ends
+	class ReadGuard
+	{
+	public:
+		explicit ReadGuard(std::atomic<std::ptrdiff_t>& count) : m_count(count)
+		{
+		}
+
+		ReadGuard(const ReadGuard&) = delete;
+		ReadGuard& operator=(const ReadGuard&) = delete;
+
+		~ReadGuard()
+		{
+			Concurrency::fetch_sub(m_count, std::ptrdiff_t{ 1 }, std::memory_order_release);
+		}
+
+	private:
+		std::atomic<std::ptrdiff_t>& m_count;
+	};
+
+	static_assert(sizeof(std::atomic<Control>) == sizeof(Control), "The control bytes are loaded as a vector");
+
+	// Spreads the bits of weak hashes, like the identity hash of integers.
+	// The top 7 bits are stored in the control byte, the rest selects the group.
+	static size_t mix(size_t hash)
+	{
+		uint64_t mixed = static_cast<uint64_t>(hash) * 0x9e37'79b9'7f4a'7c15ull;
+		return static_cast<size_t>(mixed ^ (mixed >> 32));
+	}
+
+	static Control h2(size_t hash)
+	{
+		return static_cast<Control>(hash >> (sizeof(size_t) * 8 - 7));
+	}
+
+	static size_t group_count(size_t slotCount)
+	{
+		return std::bit_ceil(std::max<size_t>((slotCount + c_groupSize - 1) / c_groupSize, 1));
+	}
+
+	static size_t stripe_index(size_t hash)
+	{
+		return (hash >> 16) % c_stripes;
+	}
+
+	Mutex& stripe(size_t hash)
+	{
+		return m_stripes[stripe_index(hash)].m_mutex;
+	}
+
+	// The lookup without locks. The table cannot be rebuilt under it, as it
+	// is counted as a reader of the epoch in which it started.
+	template<typename K>
+	bool lookup(const K& elem, hash_type hashValue) const
+	{
+		const size_t hash = mix(hashValue);
+		ReadGuard guard{ enter_epoch(hash) };
+		return find(*m_table.load(), hash, elem).has_value();
+	}
+
+	// Counts the caller as a reader of the current epoch. The epoch is read
+	// again after counting, since a rebuild may have started between the two
+	// steps without seeing the new reader.
+	std::atomic<std::ptrdiff_t>& enter_epoch(size_t hash) const
+	{
+		while (true)
+		{
+			const size_t epoch = m_epoch.load();
+			auto& count = m_readers[epoch & 1][stripe_index(hash)].m_count;
+			Concurrency::fetch_add(count, std::ptrdiff_t{ 1 });
+			if (m_epoch.load() == epoch)
+				return count;
+
+			Concurrency::fetch_sub(count, std::ptrdiff_t{ 1 }, std::memory_order_relaxed);
+		}
+	}
+
+	// Starts a new epoch, and waits for the lookups of the previous one.
+	// All the stripes are locked, so only one thread starts epochs.
+	void wait_for_readers()
+	{
+		const size_t epoch = m_epoch.load(std::memory_order_relaxed);
+		m_epoch.store(epoch + 1);
+
+		for (auto& readers : m_readers[epoch & 1])
+		{
+			while (readers.m_count.load() != 0)
+				Simd::pause();
+		}
+	}
+
+	template<typename K, typename F>
+	bool update_key(const K& elem, hash_type hashValue, F&& f)
+	{
+		const size_t hash = mix(hashValue);
+
+		UniqueLock lock{ stripe(hash) };
+		Table& table = *m_table.load(std::memory_order_acquire);
+
+		auto slot = find(table, hash, elem);
+		if (!slot)
+			return false;
+
+		if (!f(table.m_slots[*slot]))
+		{
+			table.m_control[*slot].store(c_deleted, std::memory_order_release);
+			m_size.add(-1);
+		}
+
+		return true;
+	}
+
+	// Bit i of the result is set if control byte i of the group equals 'value'
+	static uint32_t match(const std::atomic<Control>* group, Control value)
+	{
+#if defined(MIXEDSET_X86) && !defined(MIXEDSET_TSAN)
+		// The bytes are read with a plain load; a matching byte is read again atomically.
+		// ThreadSanitizer builds use the atomic loads below, which it can follow.
+		__m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+		return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(value))));
+#else
+		uint32_t result = 0;
+		for (size_t i = 0; i < c_groupSize; i++)
+		{
+			if (group[i].load(std::memory_order_relaxed) == value)
+				result |= uint32_t{ 1 } << i;
+		}
+		return result;
+#endif
+	}
+
+	// The slot of 'elem'. The groups are visited in triangular order from the
+	// home group, which reaches every group once, as their number is a power
+	// of two. The search ends at the first group with an empty slot, because
+	// an insert would have used that slot.
+	template<typename K>
+	std::optional<size_t> find(const Table& table, size_t hash, const K& elem) const
+	{
+		const Control tag = h2(hash);
+		const size_t mask = table.m_groupCount - 1;
+		size_t group = (hash >> 7) & mask;
+
+		for (size_t i = 0; i < table.m_groupCount; i++)
+		{
+			const auto* control = &table.m_control[group * c_groupSize];
+
+			for (uint32_t candidates = match(control, tag); candidates; candidates &= candidates - 1)
+			{
+				size_t slot = group * c_groupSize + std::countr_zero(candidates);
+				if (table.m_control[slot].load(std::memory_order_acquire) == tag && table.m_slots[slot] == elem)
+					return slot;
+			}
+
+			if (match(control, c_empty))
+				return std::nullopt;
+
+			group = (group + i + 1) & mask;
+		}
+
+		return std::nullopt;
+	}
+
+	// Claims an empty slot on the probe sequence for an insert, or returns
+	// nothing if the table should grow first
+	std::optional<size_t> claim(Table& table, size_t hash)
+	{
+		const size_t mask = table.m_groupCount - 1;
+		size_t group = (hash >> 7) & mask;
+
+		for (size_t i = 0; i < std::min(table.m_groupCount, c_maxProbeGroups); i++)
+		{
+			auto* control = &table.m_control[group * c_groupSize];
+
+			// Other stripes can claim the same slots
+			for (uint32_t empty = match(control, c_empty); empty; empty &= empty - 1)
+			{
+				size_t slot = group * c_groupSize + std::countr_zero(empty);
+				Control expected = c_empty;
+				while (expected == c_empty && !Concurrency::compare_exchange_weak(table.m_control[slot], expected, c_claimed, std::memory_order_acquire))
+				{
+				}
+
+				if (expected == c_empty)
+				{
+					m_used.add(1);
+
+					// The slot cannot become empty again: an insert of another element
+					// might have passed this group because of the claim
+					if (over_max_load(table))
+					{
+						table.m_control[slot].store(c_deleted, std::memory_order_release);
+						return std::nullopt;
+					}
+
+					return slot;
+				}
+			}
+
+			group = (group + i + 1) & mask;
+		}
+
+		return std::nullopt;
+	}
+
+	// Whether more slots are used than the max load factor allows. The
+	// approximate count is only good enough far below the limit, otherwise
+	// the exact one is read, which sums all the shards.
+	bool over_max_load(const Table& table) const
+	{
+		const auto limit = static_cast<std::ptrdiff_t>(max_load_factor() * table.m_groupCount * c_groupSize);
+		return m_used.approximate() + Concurrency::Counter::c_maxError > limit && m_used.load() > limit;
+	}
+
+	void lock_all(std::array<UniqueLock, c_stripes>& locks)
+	{
+		for (size_t i = 0; i < c_stripes; i++)
+			locks[i] = UniqueLock{ m_stripes[i].m_mutex };
+	}
+
+	// Rebuilds the table with twice the capacity if it is full. If the deleted
+	// slots take up the space, they are cleaned in place, or the table is
+	// rebuilt with the same capacity when that frees too few of them or the
+	// probe sequences are too long. If another thread has already rebuilt
+	// 'table', there is nothing to do.
+	void grow(Table* table)
+	{
+		std::array<UniqueLock, c_stripes> locks;
+		lock_all(locks);
+
+		if (m_table.load(std::memory_order_relaxed) != table)
+			return;
+
+		const size_t groupCount = table->m_groupCount;
+		const bool full = size() >= max_load_factor() * groupCount * c_groupSize / 2;
+		// Cleaning in place does not shorten the probe sequences, as it keeps the
+		// passed groups full, so it only helps if the claim hit the max load factor
+		if (!full && over_max_load(*table) && clean_deleted(*table))
+		{
+			// The freed slots can be claimed once no lookup reads their old elements
+			wait_for_readers();
+			return;
+		}
+
+		rebuild(*table, full ? groupCount * 2 : groupCount);
+	}
+
+	// Turns the deleted markers back to empty slots in the groups which no
+	// element has passed on its probe sequence. The other groups are left
+	// unchanged, so concurrent lookups still find every element. Returns
+	// false if too few slots were freed, and the table has to be rebuilt.
+	// All the stripes are locked.
+	bool clean_deleted(Table& table)
+	{
+		const size_t mask = table.m_groupCount - 1;
+		std::vector<bool> passed(table.m_groupCount);
+
+		for (size_t slot = 0; slot < table.m_groupCount * c_groupSize; slot++)
+		{
+			if (table.m_control[slot].load(std::memory_order_relaxed) < 0)
+				continue;
+
+			size_t hash = mix(m_hasher(table.m_slots[slot]));
+			size_t group = (hash >> 7) & mask;
+			for (size_t i = 0; group != slot / c_groupSize; i++)
+			{
+				passed[group] = true;
+				group = (group + i + 1) & mask;
+			}
+		}
+
+		size_t used = 0;
+		for (size_t slot = 0; slot < table.m_groupCount * c_groupSize; slot++)
+		{
+			Control control = table.m_control[slot].load(std::memory_order_relaxed);
+			if (control == c_deleted && !passed[slot / c_groupSize])
+				table.m_control[slot].store(c_empty, std::memory_order_relaxed);
+			else if (control != c_empty)
+				used++;
+		}
+
+		m_used.reset();
+		m_used.add(static_cast<std::ptrdiff_t>(used));
+		return used <= max_load_factor() * table.m_groupCount * c_groupSize * 3 / 4;
+	}
+
+	// Copies the elements into a new table. All the stripes are locked.
+	void rebuild(const Table& table, size_t groupCount)
+	{
+		auto newTable = std::make_unique<Table>(groupCount);
+		const size_t mask = groupCount - 1;
+
+		size_t used = 0;
+		for (size_t slot = 0; slot < table.m_groupCount * c_groupSize; slot++)
+		{
+			Control control = table.m_control[slot].load(std::memory_order_relaxed);
+			if (control < 0)
+				continue;
+
+			size_t hash = mix(m_hasher(table.m_slots[slot]));
+			size_t group = (hash >> 7) & mask;
+			for (size_t i = 0; !match(&newTable->m_control[group * c_groupSize], c_empty); i++)
+				group = (group + i + 1) & mask;
+
+			size_t newSlot = group * c_groupSize + std::countr_zero(match(&newTable->m_control[group * c_groupSize], c_empty));
+			newTable->m_slots[newSlot] = table.m_slots[slot];
+			newTable->m_control[newSlot].store(control, std::memory_order_relaxed);
+			used++;
+		}
+
+		m_used.reset();
+		m_used.add(static_cast<std::ptrdiff_t>(used));
+		publish(std::move(newTable));
+	}
+
+	// Replaces the current table, and frees the old one when no lookup reads it
+	void publish(std::unique_ptr<Table> table)
+	{
+		auto oldTable = std::exchange(m_currentTable, std::move(table));
+		m_table.store(m_currentTable.get());
+
+		if (oldTable)
+			wait_for_readers();
+	}
+
+	std::atomic<Table*> m_table = nullptr;
+	std::unique_ptr<Table> m_currentTable;
+	Stripe m_stripes[c_stripes];
+	// The lookups in progress, by the parity of the epoch and the stripe of the hash
+	mutable ReaderCount m_readers[2][c_stripes];
+	std::atomic<size_t> m_epoch = 0;
+	typename Concurrency::Counter m_size;
+	// The slots which are not empty, including the deleted ones
+	typename Concurrency::Counter m_used;
+	Hasher m_hasher;
+
+	std::atomic<float> m_maxLoadFactor = c_maxLoadFactor;
+};
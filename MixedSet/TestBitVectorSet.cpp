@@ -0,0 +1,531 @@
+#include "BitVectorSet.h"
+#include "Test.h"
+
+#include <algorithm>
+#include <climits>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <set>
+#include <vector>
+#include "catch.hpp"
+
+namespace
+{
+	constexpr size_t c_bitVectorSize = 100'000;
+	constexpr size_t c_batchSize = 1000;
+
+	bool MaskBit(const std::vector<uint64_t>& mask, size_t i)
+	{
+		return (mask[i / 64] >> (i % 64)) & 1;
+	}
+}
+
+TEST_CASE("Batched operations", "[bitvector]")
+{
+	BitVectorSet<> set{ c_bitVectorSize };
+	std::set<size_t> reference;
+
+	// Includes out of range indices too
+	std::vector<size_t> indices;
+	for (size_t i = 0; i < c_batchSize; i++)
+		indices.push_back(RandInt(0, static_cast<int>(c_bitVectorSize + c_bitVectorSize / 10)));
+
+	std::vector<uint64_t> mask(BitVectorSet<>::mask_words(indices.size()));
+
+	set.insert_many(indices, mask);
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		bool inserted = indices[i] < c_bitVectorSize && reference.insert(indices[i]).second;
+		CAPTURE(i, indices[i]);
+		REQUIRE(MaskBit(mask, i) == inserted);
+	}
+
+	std::vector<size_t> queries;
+	for (size_t i = 0; i < c_batchSize + 3; i++)
+		queries.push_back(i % 2 ? indices[i % indices.size()] : RandInt(0, static_cast<int>(c_bitVectorSize)));
+
+	set.contains_many(queries, mask);
+	for (size_t i = 0; i < queries.size(); i++)
+	{
+		CAPTURE(i, queries[i]);
+		REQUIRE(MaskBit(mask, i) == (reference.count(queries[i]) > 0));
+		REQUIRE(MaskBit(mask, i) == set.contains(queries[i]));
+	}
+
+	set.erase_many(queries, mask);
+	for (size_t i = 0; i < queries.size(); i++)
+	{
+		CAPTURE(i, queries[i]);
+		REQUIRE(MaskBit(mask, i) == (reference.erase(queries[i]) > 0));
+		REQUIRE_FALSE(set.contains(queries[i]));
+	}
+}
+
+TEST_CASE("Large region", "[bitvector]")
+{
+	// 1 GB of bits; only the written pages are ever backed by memory
+	constexpr size_t size = size_t{ 1 } << 33;
+	BitVectorSet<> set{ size };
+
+	REQUIRE_FALSE(set.contains(0));
+	REQUIRE_FALSE(set.contains(size / 2));
+	REQUIRE_FALSE(set.contains(size - 1));
+
+	REQUIRE(set.insert(size - 1));
+	REQUIRE(set.contains(size - 1));
+	REQUIRE_FALSE(set.insert(size));
+	REQUIRE(set.erase(size - 1));
+	REQUIRE_FALSE(set.contains(size - 1));
+
+	REQUIRE(set.insert(size / 3));
+	REQUIRE(set.insert(size / 3 + 1));
+	set.clear();
+	REQUIRE(set.size() == 0);
+	REQUIRE_FALSE(set.contains(size / 3));
+	REQUIRE_FALSE(set.find_next(0).has_value());
+}
+
+TEST_CASE("Parallel zeroing", "[bitvector]")
+{
+	std::vector<char> data(size_t{ 100 } << 20, 1);
+	PageAllocation::zero_parallel(data.data(), data.size() - 1);
+
+	REQUIRE(static_cast<size_t>(std::count(data.begin(), data.end(), 0)) == data.size() - 1);
+	REQUIRE(data.back() == 1);
+}
+
+TEST_CASE("Allocation policies", "[bitvector]")
+{
+	for (auto numa : { NumaPolicy::Default, NumaPolicy::Interleave, NumaPolicy::Local })
+	{
+		AllocationPolicy policy{ true, numa };
+		BitVectorSet<> set{ 3 * PageAllocation::c_hugePageSize * 8 + 5, policy };
+
+		// The policies are only hints, but the set has to work either way
+		CAPTURE(static_cast<int>(numa), set.allocation_policy().hugePages);
+		CHECK((set.allocation_policy().numa == numa || set.allocation_policy().numa == NumaPolicy::Default));
+
+		REQUIRE(set.insert(0));
+		REQUIRE(set.insert(3 * PageAllocation::c_hugePageSize * 8 + 4));
+		REQUIRE(set.contains(0));
+		REQUIRE(set.contains(3 * PageAllocation::c_hugePageSize * 8 + 4));
+		REQUIRE_FALSE(set.contains(PageAllocation::c_hugePageSize * 8));
+	}
+}
+
+TEST_CASE("Iteration", "[bitvector]")
+{
+	BitVectorSet<> set{ c_bitVectorSize };
+	std::set<size_t> reference;
+
+	for (size_t i = 0; i < c_batchSize; i++)
+	{
+		// Clustered, so that some words get emptied by the erases
+		size_t index = RandInt(0, 20) * 4000 + RandInt(0, 100);
+		set.insert(index);
+		reference.insert(index);
+	}
+
+	for (size_t i = 0; i < c_batchSize / 2; i++)
+	{
+		size_t index = RandInt(0, 20) * 4000 + RandInt(0, 100);
+		set.erase(index);
+		reference.erase(index);
+	}
+
+	std::vector<size_t> elements;
+	set.for_each([&elements](size_t index) { elements.push_back(index); });
+	REQUIRE(elements == std::vector<size_t>(reference.begin(), reference.end()));
+
+	for (size_t i = 0; i < c_batchSize; i++)
+	{
+		size_t index = RandInt(0, static_cast<int>(c_bitVectorSize));
+		auto expected = reference.lower_bound(index);
+
+		CAPTURE(index);
+		if (expected == reference.end())
+			REQUIRE_FALSE(set.find_next(index).has_value());
+		else
+			REQUIRE(set.find_next(index) == *expected);
+	}
+
+	REQUIRE_FALSE(set.find_next(c_bitVectorSize).has_value());
+}
+
+TEST_CASE("Parallel iteration summary", "[bitvector]")
+{
+	BitVectorSet<> set{ c_bitVectorSize };
+
+	// Every thread works on the same few words, emptying and refilling them
+	auto worker = [&set]
+	{
+		for (size_t i = 0; i < 100 * c_batchSize; i++)
+		{
+			size_t index = RandInt(0, 255);
+			if (CoinFlip())
+				set.insert(index);
+			else
+				set.erase(index);
+		}
+	};
+
+	std::vector<std::future<void>> threads;
+	for (size_t i = 0; i < 8; i++)
+		threads.push_back(std::async(std::launch::async, worker));
+	for (auto& thread : threads)
+		thread.get();
+
+	std::vector<size_t> expected;
+	for (size_t i = 0; i < 256; i++)
+	{
+		if (set.contains(i))
+			expected.push_back(i);
+	}
+
+	std::vector<size_t> elements;
+	set.for_each([&elements](size_t index) { elements.push_back(index); });
+	REQUIRE(elements == expected);
+}
+
+TEST_CASE("Size, rank and select", "[bitvector]")
+{
+	BitVectorSet<> set{ c_bitVectorSize };
+	std::set<size_t> reference;
+
+	for (size_t i = 0; i < c_batchSize; i++)
+	{
+		size_t index = RandInt(0, static_cast<int>(c_bitVectorSize - 1));
+		set.insert(index);
+		reference.insert(index);
+	}
+	for (size_t i = 0; i < c_batchSize / 2; i++)
+	{
+		size_t index = *std::next(reference.begin(), RandInt(0, static_cast<int>(reference.size() - 1)));
+		set.erase(index);
+		reference.erase(index);
+	}
+
+	REQUIRE(set.size() == reference.size());
+
+	set.build_rank_index();
+
+	std::vector<size_t> sorted(reference.begin(), reference.end());
+	for (size_t n = 0; n < sorted.size(); n++)
+	{
+		CAPTURE(n);
+		REQUIRE(set.select(n) == sorted[n]);
+		REQUIRE(set.rank(sorted[n]) == n);
+		REQUIRE(set.rank(sorted[n] + 1) == n + 1);
+	}
+
+	REQUIRE_FALSE(set.select(sorted.size()).has_value());
+	REQUIRE(set.rank(0) == 0);
+	REQUIRE(set.rank(c_bitVectorSize) == sorted.size());
+}
+
+TEST_CASE("Set operations", "[bitvector]")
+{
+	constexpr size_t size = 5 * BitVectorSet<>::c_rangeAlignment + 100;
+	BitVectorSet<> a{ size }, b{ size };
+	std::set<size_t> referenceA, referenceB;
+
+	for (size_t i = 0; i < 4 * c_batchSize; i++)
+	{
+		size_t index = RandInt(0, size - 1);
+		a.insert(index);
+		referenceA.insert(index);
+
+		index = RandInt(0, size - 1);
+		b.insert(index);
+		referenceB.insert(index);
+	}
+
+	auto elements = [](const BitVectorSet<>& set)
+	{
+		std::set<size_t> result;
+		set.for_each([&result](size_t index) { result.insert(index); });
+		return result;
+	};
+
+	auto check = [&](SetOperation op, auto&& referenceOp)
+	{
+		std::set<size_t> expected;
+		referenceOp(referenceA.begin(), referenceA.end(), referenceB.begin(), referenceB.end(),
+			std::inserter(expected, expected.end()));
+
+		BitVectorSet<> result{ size };
+		result.insert(7);
+		result.assign(op, a, b);
+		REQUIRE(elements(result) == expected);
+		REQUIRE(result.size() == expected.size());
+
+		// In place, split into ranges processed by different threads
+		BitVectorSet<> inPlace{ size };
+		inPlace.union_with(a);
+
+		std::vector<std::future<void>> threads;
+		for (size_t begin = 0; begin < size; begin += 2 * BitVectorSet<>::c_rangeAlignment)
+		{
+			threads.push_back(std::async(std::launch::async, [&, begin]
+			{
+				inPlace.assign(op, inPlace, b, begin, begin + 2 * BitVectorSet<>::c_rangeAlignment);
+			}));
+		}
+		for (auto& thread : threads)
+			thread.get();
+
+		REQUIRE(elements(inPlace) == expected);
+		REQUIRE(inPlace.size() == expected.size());
+		for (size_t i = 0; i < 100; i++)
+		{
+			size_t index = RandInt(0, size - 1);
+			auto next = expected.lower_bound(index);
+			REQUIRE(inPlace.find_next(index) == (next == expected.end() ? std::nullopt : std::optional(*next)));
+		}
+	};
+
+	SECTION("Union")
+	{
+		check(SetOperation::Union, [](auto... args) { return std::set_union(args...); });
+	}
+	SECTION("Intersection")
+	{
+		check(SetOperation::Intersection, [](auto... args) { return std::set_intersection(args...); });
+	}
+	SECTION("Difference")
+	{
+		check(SetOperation::Difference, [](auto... args) { return std::set_difference(args...); });
+	}
+	SECTION("Symmetric difference")
+	{
+		check(SetOperation::SymmetricDifference, [](auto... args) { return std::set_symmetric_difference(args...); });
+	}
+}
+
+namespace
+{
+	// Checks the scalar kernel against 'op', and the vector kernels against the scalar one
+	template<SetOperation Op, typename F>
+	void CheckKernels(const std::vector<uint64_t>& lhs, const std::vector<uint64_t>& rhs, F op)
+	{
+		const size_t count = lhs.size();
+		std::vector<uint64_t> expected(count), result(count);
+
+		BitKernels::combine_scalar<Op>(lhs.data(), rhs.data(), expected.data(), count);
+		for (size_t i = 0; i < count; i++)
+			REQUIRE(expected[i] == op(lhs[i], rhs[i]));
+
+#ifdef MIXEDSET_X86
+		if (Simd::cpu_features().avx2)
+		{
+			BitKernels::combine_avx2<Op>(lhs.data(), rhs.data(), result.data(), count);
+			REQUIRE(result == expected);
+		}
+		if (Simd::cpu_features().avx512)
+		{
+			BitKernels::combine_avx512<Op>(lhs.data(), rhs.data(), result.data(), count);
+			REQUIRE(result == expected);
+		}
+#endif
+	}
+}
+
+TEST_CASE("Set operation kernels", "[bitvector]")
+{
+	constexpr size_t count = 37;
+	std::vector<uint64_t> lhs(count), rhs(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		lhs[i] = (uint64_t(RandInt(0, INT_MAX)) << 32) | RandInt(0, INT_MAX);
+		rhs[i] = (uint64_t(RandInt(0, INT_MAX)) << 32) | RandInt(0, INT_MAX);
+	}
+
+	CheckKernels<SetOperation::Union>(lhs, rhs, [](uint64_t a, uint64_t b) { return a | b; });
+	CheckKernels<SetOperation::Intersection>(lhs, rhs, [](uint64_t a, uint64_t b) { return a & b; });
+	CheckKernels<SetOperation::Difference>(lhs, rhs, [](uint64_t a, uint64_t b) { return a & ~b; });
+	CheckKernels<SetOperation::SymmetricDifference>(lhs, rhs, [](uint64_t a, uint64_t b) { return a ^ b; });
+}
+
+TEST_CASE("Range operations", "[bitvector]")
+{
+	BitVectorSet<> set{ c_bitVectorSize };
+	std::set<size_t> reference;
+
+	for (size_t i = 0; i < 200; i++)
+	{
+		size_t begin = RandInt(0, static_cast<int>(c_bitVectorSize));
+		size_t end = begin + RandInt(0, i % 2 ? 100 : 5000);
+		bool fill = CoinFlip();
+
+		size_t expected = 0;
+		for (size_t index = begin; index < std::min(end, c_bitVectorSize); index++)
+			expected += fill ? reference.insert(index).second : reference.erase(index);
+
+		CAPTURE(begin, end, fill);
+		REQUIRE((fill ? set.set_range(begin, end) : set.clear_range(begin, end)) == expected);
+		REQUIRE(set.size() == reference.size());
+	}
+
+	std::vector<size_t> elements;
+	set.for_each([&elements](size_t index) { elements.push_back(index); });
+	REQUIRE(elements == std::vector<size_t>(reference.begin(), reference.end()));
+}
+
+TEST_CASE("Dirty page tracking", "[bitvector]")
+{
+	using Set = BitVectorSet<>;
+	constexpr size_t bitsPerPage = Set::c_dirtyPageBytes * 8;
+	Set set{ 10 * bitsPerPage + 17 };
+
+	REQUIRE(set.collect_dirty().empty());
+
+	set.insert(3 * bitsPerPage + 5);
+	set.insert(3 * bitsPerPage + 70);
+	set.insert(10 * bitsPerPage + 16);
+	REQUIRE_FALSE(set.insert(10 * bitsPerPage + 16));
+	REQUIRE(set.collect_dirty() == std::vector<size_t>{ 3, 10 });
+	REQUIRE(set.collect_dirty().empty());
+
+	// Failed modifications don't dirty the page
+	REQUIRE_FALSE(set.erase(5 * bitsPerPage));
+	REQUIRE_FALSE(set.insert(3 * bitsPerPage + 5));
+	REQUIRE(set.collect_dirty().empty());
+
+	set.set_range(bitsPerPage - 1, 2 * bitsPerPage + 1);
+	REQUIRE(set.collect_dirty() == std::vector<size_t>{ 0, 1, 2 });
+
+	REQUIRE(set.page_words(10).size() == 1);
+	REQUIRE(set.page_words(10)[0] == uint64_t{ 1 } << 16);
+	REQUIRE(set.page_words(3).size() == Set::c_dirtyPageBytes / 8);
+	REQUIRE(set.page_words(3)[0] == uint64_t{ 1 } << 5);
+
+	Set other{ 10 * bitsPerPage + 17 };
+	other.insert(3 * bitsPerPage + 5);
+	other.insert(7 * bitsPerPage);
+	set.subtract(other);
+	REQUIRE(set.collect_dirty() == std::vector<size_t>{ 3 });
+
+	set.clear();
+	REQUIRE(set.collect_dirty() == std::vector<size_t>{ 0, 1, 2, 3, 10 });
+}
+
+TEST_CASE("File persistence", "[bitvector]")
+{
+	using Set = BitVectorSet<>;
+	const auto path = std::filesystem::temp_directory_path() / "TestBitVectorSet.bits";
+	const size_t size = size_t{ 1 } << 30;
+	const std::byte parameters[] = { std::byte{ 1 }, std::byte{ 2 }, std::byte{ 3 } };
+
+	{
+		auto set = Set::create_file(path, size, parameters);
+		REQUIRE(set.capacity() == size);
+		REQUIRE(set.size() == 0);
+
+		for (size_t i = 0; i < 1000; i++)
+			set.insert(i * 1000003 % size);
+		set.set_range(size - 200, size);
+		REQUIRE(set.flush());
+	}
+
+	{
+		auto set = Set::open_file(path);
+		REQUIRE(set.capacity() == size);
+		REQUIRE(set.size() == 1200);
+		REQUIRE(std::ranges::equal(set.file_parameters().first(3), parameters));
+
+		for (size_t i = 0; i < 1000; i++)
+			REQUIRE(set.contains(i * 1000003 % size));
+		REQUIRE(set.contains(size - 1));
+		REQUIRE_FALSE(set.contains(size - 201));
+		REQUIRE(set.find_next(size - 300) == size - 200);
+
+		set.erase(size - 1);
+		set.clear();
+		set.insert(42);
+	}
+
+	{
+		auto set = Set::open_file(path);
+		REQUIRE(set.size() == 1);
+		REQUIRE(set.contains(42));
+		REQUIRE_FALSE(set.contains(1000003));
+	}
+
+	{
+		std::ofstream(path, std::ios::binary | std::ios::trunc) << "not a set file";
+	}
+	REQUIRE_THROWS_AS(Set::open_file(path), std::runtime_error);
+	REQUIRE_THROWS_AS(Set::open_file(path.string() + ".missing"), std::system_error);
+
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("Write combining", "[bitvector]")
+{
+	using Set = BitVectorSet<>;
+	Set set{ c_bitVectorSize };
+
+	{
+		Set::WriteCombiner combiner{ set };
+		REQUIRE(combiner.insert(3));
+		REQUIRE(combiner.insert(64));
+		REQUIRE(combiner.insert(3));
+		REQUIRE_FALSE(combiner.insert(c_bitVectorSize));
+
+		// Nothing is visible before the flush
+		REQUIRE_FALSE(set.contains(3));
+		REQUIRE(combiner.flush() == 2);
+		REQUIRE(set.contains(3));
+		REQUIRE(set.contains(64));
+
+		// Moving to another line applies the previous one
+		set.insert(1000);
+		REQUIRE(combiner.insert(1000));
+		REQUIRE(combiner.insert(c_bitVectorSize - 1));
+		REQUIRE(set.contains(1000));
+		REQUIRE_FALSE(set.contains(c_bitVectorSize - 1));
+		REQUIRE(combiner.flush() == 1);
+		REQUIRE(combiner.flush() == 0);
+
+		REQUIRE(combiner.insert(5000));
+	}
+
+	// The destructor flushes
+	REQUIRE(set.contains(5000));
+	REQUIRE(set.size() == 5);
+	REQUIRE(set.find_next(4000) == 5000);
+}
+
+TEST_CASE("Parallel write combining", "[bitvector]")
+{
+	constexpr size_t threadCount = 8;
+	BitVectorSet<> set{ c_bitVectorSize };
+
+	// The threads insert interleaved elements, so they all write the same lines
+	std::vector<std::future<size_t>> futures;
+	for (size_t t = 0; t < threadCount; t++)
+	{
+		futures.push_back(std::async(std::launch::async, [&set, t]
+		{
+			BitVectorSet<>::WriteCombiner combiner{ set };
+			size_t inserted = 0;
+			for (size_t i = t; i < c_bitVectorSize; i += threadCount)
+			{
+				combiner.insert(i);
+				if (i % 512 == 0)
+					inserted += combiner.flush();
+			}
+			return inserted + combiner.flush();
+		}));
+	}
+
+	size_t inserted = 0;
+	for (auto& future : futures)
+		inserted += future.get();
+
+	REQUIRE(inserted == c_bitVectorSize);
+	REQUIRE(set.size() == c_bitVectorSize);
+	REQUIRE(set.find_next(0) == 0);
+}
@@ -0,0 +1,141 @@
+#include "CounterVectorSet.h"
+#include "MixedSet.h"
+
+#include <future>
+#include <vector>
+#include "catch.hpp"
+
+namespace
+{
+	constexpr size_t c_counterSize = 10'000;
+
+	struct RangeLinearizer
+	{
+		static constexpr size_t size = 100;
+
+		std::optional<size_t> operator()(int x)
+		{
+			if (x < 0 || x >= static_cast<int>(size))
+				return std::nullopt;
+
+			return x;
+		}
+	};
+}
+
+TEMPLATE_TEST_CASE("Saturating counters", "[counter][template]", CounterVectorSet<2>, CounterVectorSet<4>, CounterVectorSet<8>,
+	(CounterVectorSet<4, ConcurrencyPolicy::Single>))
+{
+	TestType set{ c_counterSize };
+	const size_t maxCount = TestType::c_maxCount;
+
+	for (size_t i = 0; i < maxCount + 3; i++)
+		REQUIRE(set.increment(77) == std::min(i + 1, maxCount));
+
+	// The neighbours in the same word are not affected
+	REQUIRE(set.count(76) == 0);
+	REQUIRE(set.count(78) == 0);
+	REQUIRE(set.count(77) == maxCount);
+	REQUIRE(set.size() == 1);
+
+	REQUIRE(set.increment(78) == 1);
+	REQUIRE(set.size() == 2);
+
+	for (size_t i = maxCount; i > 0; i--)
+		REQUIRE(set.decrement(77) == i - 1);
+	REQUIRE(set.decrement(77) == 0);
+	REQUIRE_FALSE(set.contains(77));
+	REQUIRE(set.size() == 1);
+
+	REQUIRE(set.increment(c_counterSize) == 0);
+	REQUIRE(set.count(c_counterSize) == 0);
+}
+
+TEST_CASE("Parallel counting", "[counter]")
+{
+	constexpr size_t threadCount = 8;
+	constexpr size_t rounds = 100;
+	CounterVectorSet<8> set{ c_counterSize };
+
+	// Every thread increments each counter once per round, so neighbouring counters race in every word
+	std::vector<std::future<void>> futures;
+	for (size_t t = 0; t < threadCount; t++)
+	{
+		futures.push_back(std::async(std::launch::async, [&set]
+		{
+			for (size_t round = 0; round < rounds; round++)
+				for (size_t i = 0; i < c_counterSize; i++)
+					set.increment(i);
+		}));
+	}
+	for (auto& future : futures)
+		future.get();
+
+	const size_t expected = std::min<size_t>(threadCount * rounds, CounterVectorSet<8>::c_maxCount);
+	for (size_t i = 0; i < c_counterSize; i++)
+	{
+		if (set.count(i) != expected)
+		{
+			CAPTURE(i, set.count(i));
+			FAIL("Wrong count");
+		}
+	}
+	REQUIRE(set.size() == c_counterSize);
+}
+
+TEST_CASE("Counting MixedSet", "[counter]")
+{
+	MixedSet<int, RangeLinearizer, 128, std::hash<int>, ConcurrencyPolicy::Concurrent, CounterVectorSet<4>> set;
+
+	// Inside and outside of the linearized region
+	for (int value : { 5, 500 })
+	{
+		CAPTURE(value);
+		REQUIRE(set.count(value) == 0);
+		REQUIRE(set.increment(value) == 1);
+		REQUIRE(set.increment(value) == 2);
+		REQUIRE(set.contains(value));
+		REQUIRE(set.count(value) == 2);
+
+		for (int i = 0; i < 20; i++)
+			set.increment(value);
+		REQUIRE(set.count(value) == 15);
+
+		REQUIRE(set.decrement(value) == 14);
+		for (int i = 0; i < 14; i++)
+			set.decrement(value);
+		REQUIRE(set.count(value) == 0);
+		REQUIRE_FALSE(set.contains(value));
+		REQUIRE(set.decrement(value) == 0);
+	}
+
+	REQUIRE(set.insert(-3));
+	REQUIRE(set.increment(-3) == 2);
+	REQUIRE(set.size() == 1);
+	REQUIRE(set.erase(-3));
+	REQUIRE(set.count(-3) == 0);
+	REQUIRE(set.size() == 0);
+}
+
+TEMPLATE_TEST_CASE("Parallel counting outside of the linearized region", "[counter][template]", SplitOrderedBackend<>, SwissBackend)
+{
+	constexpr int threadCount = 8;
+	MixedSet<int, RangeLinearizer, 128, std::hash<int>, ConcurrencyPolicy::Concurrent, CounterVectorSet<8>, TestType> set;
+
+	std::vector<std::future<void>> futures;
+	for (int t = 0; t < threadCount; t++)
+	{
+		futures.push_back(std::async(std::launch::async, [&set]
+		{
+			for (int round = 0; round < 10; round++)
+				for (int value = 1000; value < 2000; value++)
+					set.increment(value);
+		}));
+	}
+	for (auto& future : futures)
+		future.get();
+
+	for (int value = 1000; value < 2000; value++)
+		REQUIRE(set.count(value) == 80);
+	REQUIRE(set.size() == 1000);
+}
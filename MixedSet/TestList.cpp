@@ -167,3 +167,32 @@ TEST_CASE("Sequential erase", "[list]")
 		testErase(ints);
 	}
 }
+
+TEST_CASE("Compaction", "[list]")
+{
+	constexpr int n = static_cast<int>(N);
+	auto list = IntList();
+	for (int i = 1; i <= n; ++i)
+		list.insert(i);
+
+	// The underfull nodes are merged by the erases
+	for (int i = 1; i <= n; ++i)
+	{
+		if (i % 8 != 0)
+			REQUIRE(list.erase(i));
+	}
+	list.compact();
+
+	auto upper = IntList();
+	for (int i = n + 1; i <= 2 * n; ++i)
+		upper.insert(i);
+	list.append(upper);
+
+	for (int i = 1; i <= 2 * n; ++i)
+		REQUIRE(list.contains(i) == (i > n || i % 8 == 0));
+
+	REQUIRE(list.insert(3));
+	REQUIRE(list.erase(2 * n));
+	REQUIRE(list.contains(3));
+	REQUIRE_FALSE(list.contains(2 * n));
+}
@@ -0,0 +1,68 @@
+#include "RoaringSet.h"
+#include "Test.h"
+
+#include <set>
+#include "catch.hpp"
+
+namespace
+{
+	constexpr size_t c_roaringSize = 5 * 65536 + 123;
+
+	void RequireSame(const RoaringSet<>& set, const std::set<size_t>& reference)
+	{
+		REQUIRE(set.size() == reference.size());
+		for (size_t i = 0; i < c_roaringSize; i++)
+		{
+			if (set.contains(i) != (reference.count(i) > 0))
+			{
+				CAPTURE(i);
+				FAIL("Set and reference differ");
+			}
+		}
+	}
+}
+
+TEST_CASE("Container conversions", "[roaring]")
+{
+	RoaringSet<> set{ c_roaringSize };
+	std::set<size_t> reference;
+
+	// Enough elements in one chunk to turn it into a bitmap
+	for (size_t i = 0; i < 6000; i++)
+	{
+		size_t index = 65536 + RandInt(0, 20000);
+		REQUIRE(set.insert(index) == reference.insert(index).second);
+	}
+	RequireSame(set, reference);
+
+	// And back into an array
+	while (reference.size() > 1000)
+	{
+		size_t index = *reference.begin();
+		REQUIRE(set.erase(index));
+		reference.erase(index);
+		REQUIRE_FALSE(set.erase(index));
+	}
+	RequireSame(set, reference);
+
+	// Runs, both spanning whole chunks and partial ones
+	REQUIRE(set.set_range(3 * 65536 - 10, 4 * 65536 + 100) == 65536 + 110);
+	for (size_t i = 3 * 65536 - 10; i < 4 * 65536 + 100; i++)
+		reference.insert(i);
+	REQUIRE(set.set_range(4 * 65536 + 50, 4 * 65536 + 150) == 50);
+	for (size_t i = 4 * 65536 + 100; i < 4 * 65536 + 150; i++)
+		reference.insert(i);
+	RequireSame(set, reference);
+
+	REQUIRE(set.erase(3 * 65536 + 5));
+	reference.erase(3 * 65536 + 5);
+	REQUIRE(set.insert(4 * 65536 + 151));
+	reference.insert(4 * 65536 + 151);
+	RequireSame(set, reference);
+
+	set.optimize();
+	RequireSame(set, reference);
+
+	// A fraction of what a bit vector would need
+	REQUIRE(set.memory_usage() < c_roaringSize / 8 / 2);
+}
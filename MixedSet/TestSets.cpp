@@ -1,10 +1,16 @@
 #include "BitVectorSet.h"
+#include "CounterVectorSet.h"
 #include "HashSet.h"
 #include "MixedSet.h"
+#include "RoaringSet.h"
+#include "SwissHashSet.h"
+#include "vec3.h"
 #include <optional>
 #include <future>
 #include <iostream>
 #include <random>
+#include <string>
+#include <string_view>
 #include "catch.hpp"
 
 namespace
@@ -42,12 +48,102 @@ namespace
 		}
 	};
 
-	struct TestBitVector : BitVectorSet
+	struct TestBitVector : BitVectorSet<>
 	{
-		TestBitVector() : BitVectorSet(c_testSize)
+		TestBitVector() : BitVectorSet<>(c_testSize)
 		{
 		}
 	};
+
+	struct TestRoaring : RoaringSet<>
+	{
+		TestRoaring() : RoaringSet<>(c_testSize)
+		{
+		}
+	};
+
+	struct TestCounter : CounterVectorSet<>
+	{
+		TestCounter() : CounterVectorSet<>(c_testSize)
+		{
+		}
+	};
+
+	using WideHashSet = HashSet<int, 128, std::hash<int>, ConcurrencyPolicy::Concurrent, uint64_t>;
+	using CountingMixedSet = MixedSet<int, TestLinearizer, 128, std::hash<int>, ConcurrencyPolicy::Concurrent, CounterVectorSet<4>>;
+	using SwissMixedSet = MixedSet<int, TestLinearizer, 128, std::hash<int>, ConcurrencyPolicy::Concurrent, BitVectorSet<>, SwissBackend>;
+
+	// Hashes std::string and std::string_view alike
+	struct StringHash
+	{
+		using is_transparent = void;
+
+		size_t operator()(std::string_view s) const
+		{
+			return std::hash<std::string_view>{}(s);
+		}
+	};
+
+	// Single letters are in the linearized region
+	struct StringLinearizer
+	{
+		static constexpr size_t size = 26;
+
+		std::optional<size_t> operator()(std::string_view s)
+		{
+			if (s.size() != 1 || s[0] < 'a' || s[0] > 'z')
+				return std::nullopt;
+
+			return s[0] - 'a';
+		}
+	};
+
+	// Counts its live instances, to find the slots of tables which were not freed
+	struct Tracked
+	{
+		static inline std::atomic<std::ptrdiff_t> s_live = 0;
+
+		int value = 0;
+
+		Tracked()
+		{
+			s_live++;
+		}
+
+		Tracked(int v) : value(v)
+		{
+			s_live++;
+		}
+
+		Tracked(const Tracked& other) : value(other.value)
+		{
+			s_live++;
+		}
+
+		Tracked& operator=(const Tracked&) = default;
+
+		~Tracked()
+		{
+			s_live--;
+		}
+
+		friend bool operator==(const Tracked& lhs, const Tracked& rhs)
+		{
+			return lhs.value == rhs.value;
+		}
+	};
+
+	struct TrackedHash
+	{
+		size_t operator()(const Tracked& tracked) const
+		{
+			return std::hash<int>{}(tracked.value);
+		}
+	};
+
+	using StringMixedSet = MixedSet<std::string, StringLinearizer, 128, StringHash>;
+	using StringCountingMixedSet = MixedSet<std::string, StringLinearizer, 128, StringHash, ConcurrencyPolicy::Concurrent, CounterVectorSet<4>>;
+	using StringSwissMixedSet = MixedSet<std::string, StringLinearizer, 128, StringHash, ConcurrencyPolicy::Concurrent, BitVectorSet<>, SwissBackend>;
 }
 
 template<typename Transform, typename Set>
@@ -144,12 +240,13 @@ void TestSetInsertErase(Set set)
 	}
 }
 
-TEMPLATE_TEST_CASE("Parallel insert and erase", "[set][template]", TestBitVector, (HashSet<int>), (MixedSet<int, TestLinearizer>))
+TEMPLATE_TEST_CASE("Parallel insert and erase", "[set][template]", TestBitVector, TestRoaring, TestCounter, (HashSet<int>), WideHashSet, (SwissHashSet<int>), (MixedSet<int, TestLinearizer>), (MixedSet<int, TestLinearizer, 128, std::hash<int>, ConcurrencyPolicy::Concurrent, RoaringSet<>>), CountingMixedSet, SwissMixedSet)
 {
 	TestSetInsertErase<IdentityTransform>(TestType{});
 }
 
-TEMPLATE_TEST_CASE("Basics", "[set][template]", TestBitVector, (HashSet<int>), (MixedSet<int, TestLinearizer>))
+TEMPLATE_TEST_CASE("Basics", "[set][template]", TestBitVector, TestRoaring, TestCounter, (HashSet<int>), WideHashSet, (SwissHashSet<int>), (MixedSet<int, TestLinearizer>), (MixedSet<int, TestLinearizer, 128, std::hash<int>, ConcurrencyPolicy::Concurrent, RoaringSet<>>), CountingMixedSet, SwissMixedSet,
+	(HashSet<int, 128, std::hash<int>, ConcurrencyPolicy::Single>), (SwissHashSet<int, std::hash<int>, ConcurrencyPolicy::Single>), (MixedSet<int, TestLinearizer, 128, std::hash<int>, ConcurrencyPolicy::Single>))
 {
 	TestType set;
 	
@@ -159,8 +256,10 @@ TEMPLATE_TEST_CASE("Basics", "[set][template]", TestBitVector, (HashSet<int>), (
 		REQUIRE_FALSE(set.contains(i));
 	}
 
+	REQUIRE(set.size() == 0);
 	REQUIRE(set.insert(42));
 	REQUIRE(set.contains(42));
+	REQUIRE(set.size() == 1);
 
 	for (int i = 0; i < 50; i++)
 	{
@@ -177,8 +276,10 @@ TEMPLATE_TEST_CASE("Basics", "[set][template]", TestBitVector, (HashSet<int>), (
 	REQUIRE_FALSE(set.erase(1234567890));
 	REQUIRE(set.contains(42));
 
+	REQUIRE(set.size() == 1);
 	REQUIRE(set.erase(42));
 	REQUIRE_FALSE(set.contains(42));
+	REQUIRE(set.size() == 0);
 
 	REQUIRE_FALSE(set.contains(0));
 	REQUIRE(set.insert(0));
@@ -188,3 +289,469 @@ TEMPLATE_TEST_CASE("Basics", "[set][template]", TestBitVector, (HashSet<int>), (
 	REQUIRE_FALSE(set.erase(0));
 	REQUIRE_FALSE(set.contains(0));
 }
+
+TEST_CASE("Box insert", "[set]")
+{
+	using Linearizer = Vec3Linearizer<4>;
+	MixedSet<vec3, Linearizer> set;
+
+	// Partly inside of the linearized region [-3, 4]^3
+	vec3 min{ -5, 2, -1 }, max{ 6, 7, 3 };
+	REQUIRE(set.insert({ 0, 3, 0 }));
+	REQUIRE(set.insert({ 6, 7, 3 }));
+
+	size_t boxSize = 12 * 6 * 5;
+	REQUIRE(set.insert_box(min, max) == boxSize - 2);
+	REQUIRE(set.size() == boxSize);
+	REQUIRE(set.insert_box(min, max) == 0);
+
+	for (int z = -7; z <= 8; z++)
+	{
+		for (int y = -7; y <= 8; y++)
+		{
+			for (int x = -7; x <= 8; x++)
+			{
+				bool inBox = x >= min.x && x <= max.x && y >= min.y && y <= max.y && z >= min.z && z <= max.z;
+				CAPTURE(x, y, z);
+				REQUIRE(set.contains({ x, y, z }) == inBox);
+			}
+		}
+	}
+}
+
+TEMPLATE_TEST_CASE("Clear", "[set][template]", TestBitVector, TestRoaring, TestCounter, (HashSet<int>), (SwissHashSet<int>), (MixedSet<int, TestLinearizer>), CountingMixedSet, SwissMixedSet)
+{
+	TestType set;
+
+	// For MixedSet, both inside and outside of the linearized region
+	for (int i = 0; i < 250; i += 3)
+		REQUIRE(set.insert(i));
+
+	set.clear();
+	REQUIRE(set.size() == 0);
+	for (int i = 0; i < 250; i++)
+	{
+		CAPTURE(i);
+		REQUIRE_FALSE(set.contains(i));
+	}
+
+	// The set is still usable after clearing it
+	for (int i = 0; i < 250; i += 2)
+		REQUIRE(set.insert(i));
+	for (int i = 0; i < 250; i++)
+		REQUIRE(set.contains(i) == (i % 2 == 0));
+}
+
+TEMPLATE_TEST_CASE("Parallel growth", "[set][template]", (HashSet<int>), WideHashSet, (SwissHashSet<int>))
+{
+	constexpr int threadCount = 8;
+	constexpr int perThread = 20'000;
+	TestType set(1);
+	set.max_load_factor(4);
+
+	// Lookups of elements inserted earlier run while their buckets are split
+	std::atomic<int> failures = 0;
+	std::vector<std::future<void>> futures;
+	for (int t = 0; t < threadCount; t++)
+	{
+		futures.push_back(std::async(std::launch::async, [&set, &failures, t]
+		{
+			for (int i = 0; i < perThread; i++)
+			{
+				int value = i * threadCount + t;
+				int earlier = value / 2 - value / 2 % threadCount + t;
+				if (!set.insert(value) || !set.contains(earlier))
+					failures++;
+			}
+		}));
+	}
+	for (auto& future : futures)
+		future.get();
+
+	REQUIRE(failures == 0);
+	REQUIRE(set.size() == threadCount * perThread);
+	REQUIRE(set.bucket_count() > threadCount * perThread / 8);
+
+	// The buckets are doubled
+	REQUIRE(std::has_single_bit(set.bucket_count()));
+	for (int value = 0; value < threadCount * perThread; value++)
+	{
+		if (!set.contains(value))
+		{
+			CAPTURE(value);
+			FAIL("Missing element");
+		}
+	}
+	REQUIRE_FALSE(set.contains(-1));
+}
+
+TEST_CASE("Reserve", "[set]")
+{
+	HashSet<int> set;
+	set.max_load_factor(2);
+
+	set.rehash(1000);
+	REQUIRE(set.bucket_count() == 1024);
+	set.rehash(10);
+	REQUIRE(set.bucket_count() == 1024);
+
+	set.reserve(100'000);
+	const size_t bucketCount = set.bucket_count();
+	REQUIRE(bucketCount >= 50'000);
+
+	for (int i = 0; i < 100'000; i++)
+		REQUIRE(set.insert(i));
+
+	// Reserved buckets do not grow
+	REQUIRE(set.bucket_count() == bucketCount);
+	REQUIRE(set.size() == 100'000);
+	for (int i = 0; i < 100'000; i++)
+		REQUIRE(set.contains(i));
+
+	MixedSet<int, TestLinearizer> mixed;
+	mixed.reserve(1000);
+	REQUIRE(mixed.insert(-5));
+	REQUIRE(mixed.insert(5));
+	REQUIRE(mixed.contains(-5));
+	REQUIRE(mixed.size() == 2);
+}
+
+TEMPLATE_TEST_CASE("Concurrent iteration", "[set][template]", (HashSet<int>), WideHashSet)
+{
+	constexpr int stable = 50'000;
+	TestType set(1);
+	set.max_load_factor(4);
+	for (int i = 0; i < stable; i++)
+		REQUIRE(set.insert(2 * i));
+
+	// The buckets are split by the inserts during the iteration
+	auto inserter = std::async(std::launch::async, [&set]
+	{
+		for (int i = 0; i < 4 * stable; i++)
+			set.insert(2 * i + 1);
+	});
+
+	std::vector<int> visits(8 * stable);
+	size_t duplicates = 0;
+	while (inserter.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+	{
+		std::fill(visits.begin(), visits.end(), 0);
+		set.for_each([&](int value)
+		{
+			duplicates += visits[value]++ > 0;
+		});
+
+		REQUIRE(duplicates == 0);
+		for (int i = 0; i < stable; i++)
+			REQUIRE(visits[2 * i] == 1);
+	}
+	inserter.get();
+
+	size_t count = 0;
+	set.for_each([&count](int)
+	{
+		count++;
+	});
+	REQUIRE(count == 5 * stable);
+}
+
+TEST_CASE("Snapshot", "[set]")
+{
+	HashSet<int> set(1);
+	set.max_load_factor(4);
+	for (int i = 0; i < 10'000; i++)
+		REQUIRE(set.insert(i));
+
+	auto snapshot = set.snapshot();
+
+	// Erases, inserts and splits of the buckets after the snapshot
+	for (int i = 0; i < 10'000; i += 2)
+		REQUIRE(set.erase(i));
+	for (int i = 10'000; i < 50'000; i++)
+		REQUIRE(set.insert(i));
+	auto later = set.snapshot();
+	for (int i = 0; i < 10'000; i++)
+		set.insert(i);
+
+	std::vector<int> elements;
+	snapshot.for_each([&elements](int value)
+	{
+		elements.push_back(value);
+	});
+	std::sort(elements.begin(), elements.end());
+	REQUIRE(elements.size() == 10'000);
+	for (int i = 0; i < 10'000; i++)
+		REQUIRE(elements[i] == i);
+
+	REQUIRE(later.size() == 45'000);
+	REQUIRE(set.size() == 50'000);
+
+	CountingMixedSet mixed;
+	REQUIRE(mixed.increment(-1) == 1);
+	REQUIRE(mixed.increment(-1) == 2);
+	REQUIRE(mixed.increment(5) == 1);
+	REQUIRE(mixed.increment(200) == 1);
+
+	auto sparse = mixed.sparse_snapshot();
+	REQUIRE(mixed.decrement(-1) == 1);
+
+	std::vector<std::pair<int, size_t>> counts;
+	sparse.for_each([&counts](const Counted<int>& counted)
+	{
+		counts.emplace_back(counted.value, counted.count);
+	});
+	std::sort(counts.begin(), counts.end());
+	REQUIRE(counts == std::vector<std::pair<int, size_t>>{ { -1, 2 }, { 200, 1 } });
+
+	std::vector<int> values;
+	mixed.for_each_sparse([&values](int value)
+	{
+		values.push_back(value);
+	});
+	std::sort(values.begin(), values.end());
+	REQUIRE(values == std::vector<int>{ -1, 200 });
+}
+
+TEST_CASE("Shrinking", "[set]")
+{
+	constexpr int count = 100'000;
+	HashSet<int> set(1);
+	set.max_load_factor(4);
+	for (int i = 0; i < count; i++)
+		REQUIRE(set.insert(i));
+	const size_t peak = set.bucket_count();
+
+	// The erases merge the buckets
+	for (int i = 0; i < count; i++)
+	{
+		if (i % 100 != 0)
+			REQUIRE(set.erase(i));
+	}
+	REQUIRE(set.bucket_count() < peak / 8);
+	for (int i = 0; i < count; i++)
+		REQUIRE(set.contains(i) == (i % 100 == 0));
+
+	set.shrink_to_fit();
+	REQUIRE(set.bucket_count() == std::bit_ceil<size_t>(count / 100 / 4));
+	REQUIRE(set.size() == count / 100);
+
+	// And it grows again
+	for (int i = 0; i < count; i++)
+		REQUIRE(set.insert(i) == (i % 100 != 0));
+	REQUIRE(set.bucket_count() >= count / 4);
+	for (int i = 0; i < count; i++)
+		REQUIRE(set.contains(i));
+}
+
+TEMPLATE_TEST_CASE("Sliding window", "[set][template]", (HashSet<int>), WideHashSet)
+{
+	// Each thread erases as many elements as it inserts, so the table grows and shrinks
+	constexpr int threadCount = 8;
+	constexpr int window = 5'000;
+	constexpr int perThread = 100'000;
+	TestType set(1);
+	set.max_load_factor(4);
+
+	std::atomic<int> failures = 0;
+	std::vector<std::future<void>> futures;
+	for (int t = 0; t < threadCount; t++)
+	{
+		futures.push_back(std::async(std::launch::async, [&set, &failures, t]
+		{
+			for (int i = 0; i < perThread; i++)
+			{
+				const int size = i % (4 * window) < 2 * window ? window : window / 50;
+				if (!set.insert(i * threadCount + t))
+					failures++;
+				for (int old = i - size; old >= 0 && set.contains(old * threadCount + t); old--)
+				{
+					if (!set.erase(old * threadCount + t))
+						failures++;
+				}
+				if (i >= window && !set.contains((i - window / 100) * threadCount + t))
+					failures++;
+			}
+		}));
+	}
+	for (auto& future : futures)
+		future.get();
+
+	REQUIRE(failures == 0);
+	REQUIRE(set.size() <= threadCount * window);
+	size_t count = 0;
+	set.for_each([&count](int)
+	{
+		count++;
+	});
+	REQUIRE(count == set.size());
+}
+
+TEST_CASE("Open addressing load factor", "[set]")
+{
+	for (float maxLoadFactor : { SwissHashSet<int>::c_maxLoadFactor, 0.5f })
+	{
+		SwissHashSet<int> set;
+		set.max_load_factor(maxLoadFactor);
+		for (int i = 0; i < 20'000; i++)
+		{
+			REQUIRE(set.insert(i));
+			REQUIRE(set.load_factor() <= set.max_load_factor());
+		}
+
+		// The deleted slots count as used until the table is rebuilt
+		for (int i = 0; i < 20'000; i++)
+		{
+			REQUIRE(set.erase(i));
+			REQUIRE(set.insert(20'000 + i));
+			REQUIRE(set.load_factor() <= set.max_load_factor());
+		}
+		REQUIRE(set.size() == 20'000);
+	}
+}
+
+TEST_CASE("Table reclamation", "[set]")
+{
+	constexpr int stable = 100;
+	constexpr int window = 1000;
+	constexpr int writerCount = 2;
+	constexpr int steps = 400'000;
+	{
+		SwissHashSet<Tracked, TrackedHash> set;
+		for (int i = 0; i < stable; i++)
+			REQUIRE(set.insert(-1 - i));
+
+		// The erases leave deleted slots behind, which the rebuilds reclaim,
+		// while lookups read the tables
+		std::atomic<bool> done = false;
+		std::atomic<int> failures = 0;
+		std::vector<std::future<void>> readers;
+		for (int t = 0; t < 2; t++)
+		{
+			readers.push_back(std::async(std::launch::async, [&]
+			{
+				while (!done)
+				{
+					for (int i = 0; i < stable; i++)
+						failures += !set.contains(-1 - i);
+				}
+			}));
+		}
+
+		std::vector<std::future<void>> writers;
+		for (int t = 0; t < writerCount; t++)
+		{
+			writers.push_back(std::async(std::launch::async, [&set, &failures, t]
+			{
+				for (int i = 0; i < steps; i++)
+				{
+					failures += !set.insert(t * steps + i);
+					if (i >= window)
+						failures += !set.erase(t * steps + i - window);
+				}
+			}));
+		}
+		for (auto& writer : writers)
+			writer.get();
+		done = true;
+		for (auto& reader : readers)
+			reader.get();
+
+		REQUIRE(failures == 0);
+		REQUIRE(set.size() == stable + writerCount * window);
+		REQUIRE(set.bucket_count() <= 8192);
+
+		// Only the slots of the current table are alive
+		REQUIRE(Tracked::s_live == static_cast<std::ptrdiff_t>(set.bucket_count()));
+	}
+	REQUIRE(Tracked::s_live == 0);
+}
+
+TEMPLATE_TEST_CASE("Precomputed hashes", "[set][template]", (HashSet<int>), WideHashSet, (SwissHashSet<int>), (MixedSet<int, TestLinearizer>), CountingMixedSet, SwissMixedSet)
+{
+	TestType set;
+	const auto hasher = set.hash_function();
+
+	for (int i = -500; i < 500; i++)
+		REQUIRE(set.insert_hashed(i, hasher(i)));
+	for (int i = -500; i < 500; i++)
+	{
+		REQUIRE_FALSE(set.insert(i));
+		REQUIRE(set.contains(i));
+		REQUIRE(set.contains_hashed(i, hasher(i)));
+	}
+
+	// The hashes are the ones the set computes itself
+	for (int i = -500; i < 500; i += 2)
+		REQUIRE(set.erase_hashed(i, hasher(i)));
+	for (int i = -500; i < 500; i++)
+		REQUIRE(set.contains(i) == (i % 2 != 0));
+	REQUIRE_FALSE(set.erase_hashed(-500, hasher(-500)));
+	REQUIRE(set.size() == 500);
+}
+
+TEMPLATE_TEST_CASE("Transparent lookup", "[set][template]", (HashSet<std::string, 128, StringHash>), (SwissHashSet<std::string, StringHash>), StringMixedSet, StringCountingMixedSet, StringSwissMixedSet)
+{
+	TestType set;
+	std::vector<std::string> elems;
+	for (char c = 'a'; c <= 'z'; c++)
+	{
+		elems.emplace_back(1, c);
+		elems.emplace_back(40, c);
+	}
+	for (const auto& elem : elems)
+		REQUIRE(set.insert(elem));
+
+	// The lookups take views into another buffer, not the stored strings
+	std::string buffer(40, 'z');
+	for (const auto& elem : elems)
+	{
+		buffer.replace(0, std::string::npos, elem);
+		const std::string_view key = buffer;
+		REQUIRE(set.contains(key));
+		REQUIRE(set.contains_hashed(key, StringHash{}(key)));
+	}
+	REQUIRE_FALSE(set.contains(std::string_view{ "ab" }));
+	REQUIRE_FALSE(set.contains(std::string_view{ std::string(39, 'a') }));
+
+	for (char c = 'a'; c <= 'z'; c += 2)
+	{
+		const std::string big(40, c);
+		REQUIRE(set.erase(std::string_view{ big }.substr(0, 1)));
+		REQUIRE(set.erase_hashed(std::string_view{ big }, StringHash{}(big)));
+		REQUIRE_FALSE(set.erase(std::string_view{ big }));
+	}
+	for (const auto& elem : elems)
+		REQUIRE(set.contains(std::string_view{ elem }) == ((elem[0] - 'a') % 2 != 0));
+	REQUIRE(set.size() == 26);
+}
+
+TEST_CASE("Sharded counter", "[set]")
+{
+	constexpr int threadCount = 8;
+	constexpr int perThread = 10'000;
+	ShardedCounter counter;
+
+	std::vector<std::future<void>> futures;
+	for (int t = 0; t < threadCount; t++)
+	{
+		futures.push_back(std::async(std::launch::async, [&counter]
+		{
+			for (int i = 0; i < perThread; i++)
+				counter.add(i % 3 == 0 ? -1 : 2);
+		}));
+	}
+	for (auto& future : futures)
+		future.get();
+
+	std::ptrdiff_t exact = 0;
+	for (int i = 0; i < perThread; i++)
+		exact += i % 3 == 0 ? -1 : 2;
+	exact *= threadCount;
+
+	REQUIRE(counter.load() == exact);
+	REQUIRE(std::abs(counter.approximate() - exact) < static_cast<std::ptrdiff_t>(ShardedCounter::c_shards) * ShardedCounter::c_batch);
+
+	counter.reset();
+	REQUIRE(counter.load() == 0);
+	REQUIRE(counter.approximate() == 0);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "MixedSet.h"
+#include <algorithm>
 #include <optional>
 
 struct vec3
@@ -55,4 +56,49 @@ struct Vec3Linearizer
 
 		return value.x + 2 * halfwidth * value.y + 4 * halfwidth * halfwidth * value.z;
 	}
+
+	// Visits the box [min, max] (inclusive) row by row: the part of each x-row which is
+	// in range is passed to 'run' as a half-open range of indices, the other points to 'outside'.
+	template<typename RunF, typename PointF>
+	void for_each_run(vec3 min, vec3 max, RunF&& run, PointF&& outside)
+	{
+		constexpr long long lowest = 1 - static_cast<long long>(halfwidth);
+		constexpr long long highest = halfwidth;
+
+		auto isInRange = [](long long v)
+		{
+			return v >= lowest && v <= highest;
+		};
+
+		auto visitOutside = [&outside](long long from, long long to, int y, int z)
+		{
+			for (long long x = from; x <= to; x++)
+				outside(vec3{ static_cast<int>(x), y, z });
+		};
+
+		for (long long z = min.z; z <= max.z; z++)
+		{
+			for (long long y = min.y; y <= max.y; y++)
+			{
+				int rowY = static_cast<int>(y);
+				int rowZ = static_cast<int>(z);
+				if (!isInRange(y) || !isInRange(z))
+				{
+					visitOutside(min.x, max.x, rowY, rowZ);
+					continue;
+				}
+
+				long long from = std::max<long long>(min.x, lowest);
+				long long to = std::min<long long>(max.x, highest);
+
+				visitOutside(min.x, std::min<long long>(max.x, from - 1), rowY, rowZ);
+				if (from <= to)
+				{
+					size_t first = *(*this)(vec3{ static_cast<int>(from), rowY, rowZ });
+					run(first, first + static_cast<size_t>(to - from) + 1);
+				}
+				visitOutside(std::max<long long>(min.x, to + 1), max.x, rowY, rowZ);
+			}
+		}
+	}
 };